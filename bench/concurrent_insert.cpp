@@ -0,0 +1,164 @@
+/**
+ * Tokenizer throughput with N connections inserting on N threads, each into its own database
+ *
+ * usage: concurrent_insert [-t max_threads] [-r rows_per_thread] [-g gram] [-d dir] [-m]
+ *  -d      put the databases under dir instead of memory
+ *  -m      disable SQLITE_CONFIG_MEMSTATUS(its global mutex is taken by every sqlite3_malloc())
+ *
+ * Runs with 1, 2, 4, ... max_threads threads and reports the speedup against 1 thread.
+ *
+ * see: LICENSE.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "ngram.h"
+
+// Deterministic mixture of CJK and ASCII, like product titles
+static std::string make_text(unsigned seed, int n) {
+    static const char *const WORDS[] = {
+            "東京", "世界", "使用", "方法", "和平", "万岁", "iPhone", "用", "ケース", "Linux", "上", "如何",
+            "2021", "年", "新", "検索", "全文", "WeChat", "の", "は", "、", "。", "SQLite", "テスト",
+    };
+    const int nWords = sizeof(WORDS) / sizeof(WORDS[0]);
+
+    std::string s;
+    for (int i = 0; i < n; i++) {
+        seed = seed * 1103515245u + 12345u;
+        s += WORDS[(seed >> 16) % nWords];
+        if ((seed >> 8) % 5 == 0) s += ' ';
+    }
+    return s;
+}
+
+static bool exec(sqlite3 *db, const char *sql) {
+    char *zErr = nullptr;
+    if (sqlite3_exec(db, sql, nullptr, nullptr, &zErr) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", sql, zErr);
+        sqlite3_free(zErr);
+        return false;
+    }
+    return true;
+}
+
+static void worker(int id, int nRows, int gram, const std::string &dir, size_t *pBytes, bool *pOk) {
+    std::string path = dir.empty() ? ":memory:" : dir + "/bench-" + std::to_string(id) + ".db";
+    if (!dir.empty()) unlink(path.c_str());
+
+    sqlite3 *db = nullptr;
+    *pOk = false;
+    if (sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX,
+                        nullptr) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_open_v2(%s): %s\n", path.c_str(), sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return;
+    }
+
+    std::string ddl = "CREATE VIRTUAL TABLE t USING fts5(x, tokenize = 'ngram gram " + std::to_string(gram) + "')";
+    sqlite3_stmt *pStmt = nullptr;
+    if (exec(db, "PRAGMA journal_mode = OFF; PRAGMA synchronous = OFF") && exec(db, ddl.c_str()) &&
+        exec(db, "BEGIN") &&
+        sqlite3_prepare_v2(db, "INSERT INTO t VALUES(?1)", -1, &pStmt, nullptr) == SQLITE_OK) {
+        size_t nBytes = 0;
+        bool ok = true;
+        for (int i = 0; ok && i < nRows; i++) {
+            std::string text = make_text(id * 7919u + i, 40);
+            nBytes += text.size();
+            sqlite3_bind_text(pStmt, 1, text.data(), (int) text.size(), SQLITE_STATIC);
+            ok = sqlite3_step(pStmt) == SQLITE_DONE;
+            sqlite3_reset(pStmt);
+        }
+        *pBytes = nBytes;
+        *pOk = ok && exec(db, "COMMIT");
+    } else {
+        fprintf(stderr, "worker %d: %s\n", id, sqlite3_errmsg(db));
+    }
+
+    sqlite3_finalize(pStmt);
+    sqlite3_close(db);
+    if (!dir.empty()) unlink(path.c_str());
+}
+
+int main(int argc, char *argv[]) {
+    int maxThreads = (int) std::thread::hardware_concurrency();
+    int nRows = 20000;
+    int gram = 2;
+    std::string dir;
+    bool memstatus = true;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:r:g:d:m")) != -1) {
+        switch (opt) {
+            case 't':
+                maxThreads = atoi(optarg);
+                break;
+            case 'r':
+                nRows = atoi(optarg);
+                break;
+            case 'g':
+                gram = atoi(optarg);
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'm':
+                memstatus = false;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-t max_threads] [-r rows_per_thread] [-g gram] [-d dir] [-m]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (maxThreads < 1) maxThreads = 1;
+
+    if (!memstatus && sqlite3_config(SQLITE_CONFIG_MEMSTATUS, 0) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_config(SQLITE_CONFIG_MEMSTATUS) fail\n");
+        return 1;
+    }
+    if (sqlite3_ngram_register() != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_ngram_register() fail\n");
+        return 1;
+    }
+
+    std::vector<int> steps;
+    for (int n = 1; n < maxThreads; n *= 2) {
+        steps.emplace_back(n);
+    }
+    steps.emplace_back(maxThreads);
+
+    printf("threads\trows/s\tMB/s\tspeedup\n");
+    double base = 0;
+    for (int nThreads: steps) {
+        std::vector<std::thread> threads;
+        std::vector<size_t> bytes(nThreads);
+        std::unique_ptr<bool[]> ok(new bool[nThreads]);
+
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < nThreads; i++) {
+            threads.emplace_back(worker, i, nRows, gram, std::cref(dir), &bytes[i], &ok[i]);
+        }
+        for (auto &t: threads) {
+            t.join();
+        }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        size_t nBytes = 0;
+        for (int i = 0; i < nThreads; i++) {
+            if (!ok[i]) return 1;
+            nBytes += bytes[i];
+        }
+
+        double rate = (double) nRows * nThreads / secs;
+        if (nThreads == 1) base = rate;
+        printf("%d\t%.0f\t%.2f\t%.2f\n", nThreads, rate, nBytes / secs / 1e6, rate / base);
+    }
+
+    return 0;
+}
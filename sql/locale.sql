@@ -0,0 +1,15 @@
+-- Needs SQLite3 3.47.0 or later, the tokenizer is registered as FTS5 v2 there
+.load build/libngram.so
+CREATE VIRTUAL TABLE ft USING fts5(text, tokenize = 'ngram', locale = 1);
+INSERT INTO ft VALUES(fts5_locale('en', 'café au lait'));
+INSERT INTO ft VALUES(fts5_locale('ja', '東京のカフェ'));
+INSERT INTO ft VALUES('café au lait');
+
+-- 1: words of the row in the same locale
+SELECT group_concat(rowid) FROM ft WHERE ft MATCH fts5_locale('en', 'café');
+-- 3: without a locale the query is split into grams, which only the row without a locale has
+SELECT group_concat(rowid) FROM ft WHERE ft MATCH 'café';
+-- 1,3: an ASCII word is the same term either way
+SELECT group_concat(rowid) FROM ft WHERE ft MATCH 'au';
+-- 2: ja is split into grams as without a locale
+SELECT group_concat(rowid) FROM ft WHERE ft MATCH 'カフェ';
@@ -0,0 +1,48 @@
+.open --new /tmp/ngram_maintain.db
+.load build/libngram.so sqlite3_ngram_tools_init
+CREATE VIRTUAL TABLE ft USING fts5(text, tokenize = 'ngram gram 2');
+INSERT INTO ft(ft, rank) VALUES('automerge', 0);
+-- One segment per transaction
+INSERT INTO ft VALUES('東京タワー1');
+INSERT INTO ft VALUES('東京タワー2');
+INSERT INTO ft VALUES('東京タワー3');
+INSERT INTO ft VALUES('東京タワー4');
+INSERT INTO ft VALUES('東京タワー5');
+INSERT INTO ft VALUES('東京タワー6');
+INSERT INTO ft VALUES('東京タワー7');
+INSERT INTO ft VALUES('東京タワー8');
+INSERT INTO ft VALUES('東京タワー9');
+INSERT INTO ft VALUES('東京タワー10');
+
+-- Nothing to do without time
+SELECT ngram_maintain('ft', 0);
+-- {"steps":1,"pages":...,"done":true,...}
+SELECT json_extract(value, '$.steps'), json_extract(value, '$.done')
+FROM (SELECT ngram_maintain('ft', 50) AS value);
+-- The merge is a no-op once done
+SELECT json_extract(value, '$.steps'), json_extract(value, '$.done')
+FROM (SELECT ngram_maintain('ft', 50) AS value);
+
+-- A background worker every 10 ms, NULL until it has run once
+INSERT INTO ft VALUES('京都タワー1');
+INSERT INTO ft VALUES('京都タワー2');
+INSERT INTO ft VALUES('京都タワー3');
+INSERT INTO ft VALUES('京都タワー4');
+INSERT INTO ft VALUES('京都タワー5');
+INSERT INTO ft VALUES('京都タワー6');
+INSERT INTO ft VALUES('京都タワー7');
+INSERT INTO ft VALUES('京都タワー8');
+INSERT INTO ft VALUES('京都タワー9');
+INSERT INTO ft VALUES('京都タワー10');
+SELECT ngram_maintain('ft', 20, 10) IS NULL;
+WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM c WHERE i < 3000000) SELECT count(*) > 0 FROM c;
+SELECT json_extract(ngram_maintain('ft', 20, 10), '$.done');
+SELECT json_extract(ngram_maintain('ft', 50), '$.steps');
+-- Stop it
+SELECT ngram_maintain('ft', 20, 0) IS NOT NULL;
+INSERT INTO ft(ft) VALUES('integrity-check');
+SELECT count(*) FROM ft WHERE ft MATCH 'タワー';
+
+-- Not an ngram table
+CREATE VIRTUAL TABLE plain USING fts5(text);
+SELECT ngram_maintain('plain', 10);
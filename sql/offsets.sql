@@ -0,0 +1,49 @@
+.load build/libngram.so sqlite3_ngram_tools_init
+CREATE VIRTUAL TABLE ft USING fts5(text, tokenize = 'ngram gram 2');
+INSERT INTO ft VALUES('メロスは激怒した。必ず、かの邪智暴虐の王を除かなければならぬと決意した。');
+SELECT ngram_offsets_enable('ft');
+
+-- [メロス]は激怒した。必ず、かの邪智暴虐の王を除かなければならぬと決意した。
+SELECT ngram_offsets_highlight(ft, 0, '[', ']', 'ft') FROM ft WHERE ft MATCH 'メロス';
+-- …の[邪智暴虐]の…
+SELECT ngram_snippet(ft, -1, '[', ']', '…', 5, 'ft') FROM ft WHERE ft MATCH '邪智暴虐';
+-- Same as the built-in ones
+SELECT highlight(ft, 0, '[', ']') FROM ft WHERE ft MATCH 'メロス';
+SELECT snippet(ft, -1, '[', ']', '…', 5) FROM ft WHERE ft MATCH '邪智暴虐';
+
+-- The positions of another value have another size, the value is tokenized again and counted as a miss
+UPDATE ft_ngram_offsets SET c0 = ngram_offsets('メロス', 'gram 2');
+SELECT ngram_stat('offsets_misses');
+SELECT ngram_offsets_highlight(ft, 0, '[', ']', 'ft') FROM ft WHERE ft MATCH '激怒';
+SELECT ngram_stat('offsets_misses');
+
+-- The triggers go with the table, the sidecar table stays until ngram_offsets_disable()
+DROP TABLE ft;
+SELECT type, name FROM sqlite_master;
+SELECT ngram_offsets_disable('ft');
+SELECT count(*) FROM sqlite_master;
+
+-- An external content table takes the triggers itself, the columns are read by name
+CREATE TABLE docs(doc_id INTEGER PRIMARY KEY, title, body);
+CREATE VIRTUAL TABLE docs_ft USING fts5(title, body, content = 'docs', content_rowid = 'doc_id',
+                                        tokenize = 'ngram gram 2');
+INSERT INTO docs VALUES(10, '走れメロス', 'メロスは激怒した。');
+INSERT INTO docs_ft(docs_ft) VALUES('rebuild');
+SELECT ngram_offsets_enable('DOCS_FT');
+INSERT INTO docs VALUES(20, '人間失格', '恥の多い生涯を送って来ました。');
+INSERT INTO docs_ft(rowid, title, body) VALUES(20, '人間失格', '恥の多い生涯を送って来ました。');
+-- table|docs_ft_ngram_offsets and the three triggers on docs
+SELECT type, name, tbl_name FROM sqlite_master WHERE name LIKE 'docs_ft_ngram%' ORDER BY name;
+SELECT ngram_stat('offsets_hits');
+-- 恥の多い[生涯]を送って来ました。
+SELECT ngram_offsets_highlight(docs_ft, 1, '[', ']', 'docs_ft') FROM docs_ft WHERE docs_ft MATCH '生涯';
+-- one more hit
+SELECT ngram_stat('offsets_hits');
+DELETE FROM docs WHERE doc_id = 10;
+SELECT group_concat(id) FROM docs_ft_ngram_offsets;
+SELECT ngram_offsets_disable('docs_ft');
+SELECT count(*) FROM sqlite_master WHERE name LIKE 'docs_ft_ngram%';
+
+-- A contentless table has nothing to record
+CREATE VIRTUAL TABLE cl USING fts5(x, content = '', tokenize = 'ngram gram 2');
+SELECT ngram_offsets_enable('cl');
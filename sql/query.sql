@@ -0,0 +1,30 @@
+.load build/libngram.so sqlite3_ngram_tools_init
+CREATE VIRTUAL TABLE ft USING fts5(text, tokenize = 'ngram gram 2');
+INSERT INTO ft VALUES('東京タワーに行く'), ('京都タワー'), ('東北'), ('Linuxの東京タワー'), ('大阪城'), ('東');
+
+-- "linux" "東京タワー", the rarest phrase first
+SELECT ngram_query('ft', '東京タワー　東京 タワー linux');
+SELECT rowid FROM ft WHERE ft MATCH ngram_query('ft', '東京タワー　東京 タワー linux');
+SELECT ngram_query('ft', 'タワー 東京');
+
+-- A word shorter than a gram is a prefix query, more rows than MATCH of the word itself
+SELECT ngram_query('ft', '東');
+SELECT group_concat(rowid) FROM ft WHERE ft MATCH '東';
+SELECT group_concat(rowid) FROM ft WHERE ft MATCH ngram_query('ft', '東');
+-- Except at the very end of a value
+SELECT ngram_query('ft', '城');
+SELECT count(*) FROM ft WHERE ft MATCH ngram_query('ft', '城');
+
+-- Symbols and operators are plain characters, a phrase matching no row is returned alone
+SELECT ngram_query('ft', 'AND "東京');
+SELECT ngram_query('ft', '　 ') IS NULL;
+
+-- Tables of attached schemas, a function call never changes the schema
+ATTACH ':memory:' AS aux;
+CREATE VIRTUAL TABLE aux.ft USING fts5(text, tokenize = 'ngram gram 2');
+INSERT INTO aux.ft VALUES('京都タワー'), ('京都駅');
+-- "タワー" "京都"
+SELECT ngram_query('aux.FT', '京都 タワー');
+-- "東京" "タワー", main.ft as an unqualified name of a table in both schemas
+SELECT ngram_query('FT', 'タワー 東京');
+SELECT count(*) FROM temp.sqlite_master;
@@ -0,0 +1,71 @@
+.open --new /tmp/ngram_shards.db
+.load build/libngram.so sqlite3_ngram_tools_init
+ATTACH '/tmp/ngram_shards0.db' AS s0;
+ATTACH '/tmp/ngram_shards1.db' AS s1;
+DROP TABLE IF EXISTS s0.docs;
+DROP TABLE IF EXISTS s1.docs;
+CREATE VIRTUAL TABLE s0.docs USING fts5(title, body, tokenize = 'ngram gram 2');
+CREATE VIRTUAL TABLE s1.docs USING fts5(title, body, tokenize = 'ngram gram 2');
+CREATE VIRTUAL TABLE temp.docs USING ngram_shards(docs, s0, s1);
+INSERT INTO docs(title, body) VALUES('メロス', 'メロスは激怒した。');
+INSERT INTO docs(title, body) VALUES('王', '邪智暴虐の王は激怒した。'), ('妹', '妹の婚礼'), ('友', 'セリヌンティウスは激怒しない。');
+SELECT rowid, title, rank FROM docs WHERE docs MATCH '激怒' ORDER BY rank LIMIT 10;
+
+-- Rows are spread over the shards by rowid
+SELECT (SELECT count(*) FROM s0.docs), (SELECT count(*) FROM s1.docs), (SELECT count(*) FROM docs);
+SELECT title FROM docs WHERE rowid = 3;
+
+-- Uncommitted rows are seen by MATCH, rowid lookups and scans of the same connection
+BEGIN;
+INSERT INTO docs(title, body) VALUES('未確定', '未確定の行');
+SELECT count(*) FROM docs WHERE docs MATCH '未確定';
+UPDATE docs SET title = '更新' WHERE rowid = last_insert_rowid();
+SELECT title FROM docs WHERE title = '更新';
+DELETE FROM docs WHERE rowid = last_insert_rowid();
+COMMIT;
+SELECT count(*) FROM docs WHERE docs MATCH '未確定';
+
+-- Special commands go to every shard
+INSERT INTO docs(docs, rank) VALUES('optimize', 0);
+INSERT INTO docs(docs) VALUES('integrity-check');
+
+-- Four shards searched in parallel on their reader connections, ranked as one table of the same rows
+ATTACH '/tmp/ngram_shards2.db' AS s2;
+ATTACH '/tmp/ngram_shards3.db' AS s3;
+DROP TABLE IF EXISTS s0.many;
+DROP TABLE IF EXISTS s1.many;
+DROP TABLE IF EXISTS s2.many;
+DROP TABLE IF EXISTS s3.many;
+CREATE VIRTUAL TABLE s0.many USING fts5(title, body, tokenize = 'ngram gram 2');
+CREATE VIRTUAL TABLE s1.many USING fts5(title, body, tokenize = 'ngram gram 2');
+CREATE VIRTUAL TABLE s2.many USING fts5(title, body, tokenize = 'ngram gram 2');
+CREATE VIRTUAL TABLE s3.many USING fts5(title, body, tokenize = 'ngram gram 2');
+CREATE VIRTUAL TABLE temp.many USING ngram_shards(many, s0, s1, s2, s3);
+CREATE VIRTUAL TABLE single USING fts5(title, body, tokenize = 'ngram gram 2');
+CREATE TEMP VIEW rows AS
+WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM c WHERE i < 400)
+SELECT i, 'メロス' || i AS title,
+       substr('メロスは激怒した。必ず、かの邪智暴虐の王を除かなければならぬと決意した。', 1 + (i * 7) % 30, 4 + (i * 13) % 25) ||
+       CASE WHEN i % 5 = 0 THEN '王は激怒した。' ELSE '' END AS body
+FROM c;
+INSERT INTO many(rowid, title, body) SELECT i, title, body FROM rows;
+INSERT INTO single(rowid, title, body) SELECT i, title, body FROM rows;
+SELECT (SELECT count(*) FROM s0.many) > 0, (SELECT count(*) FROM s3.many) > 0, (SELECT count(*) FROM many);
+CREATE TEMP TABLE queries(q);
+INSERT INTO queries VALUES('激怒'), ('王 OR メロス'), ('"邪智暴虐" OR 王は'), ('決意'), ('なかった');
+-- query|rows|1 if the rows and ranks are the same
+SELECT q, (SELECT count(*) FROM single WHERE single MATCH q),
+       (SELECT group_concat(rowid || ':' || printf('%.9f', rank))
+        FROM (SELECT rowid, rank FROM single WHERE single MATCH q ORDER BY rank, rowid)) IS
+       (SELECT group_concat(rowid || ':' || printf('%.9f', rank))
+        FROM (SELECT rowid, rank FROM many WHERE many MATCH q ORDER BY rank, rowid))
+FROM queries;
+-- The top rows of each shard with LIMIT and OFFSET, the same ranks as of one table
+SELECT q,
+       (SELECT group_concat(printf('%.9f', rank)) FROM (SELECT rank FROM single WHERE single MATCH q ORDER BY rank LIMIT 10 OFFSET 5)) IS
+       (SELECT group_concat(printf('%.9f', rank)) FROM (SELECT rank FROM many WHERE many MATCH q ORDER BY rank LIMIT 10 OFFSET 5))
+FROM queries;
+
+-- Not an ngram table
+CREATE VIRTUAL TABLE plain USING fts5(title, body);
+CREATE VIRTUAL TABLE temp.bad USING ngram_shards(plain, main);
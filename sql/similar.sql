@@ -0,0 +1,26 @@
+.load build/libngram.so sqlite3_ngram_tools_init
+CREATE VIRTUAL TABLE names USING fts5(name, tokenize = 'ngram gram 2');
+INSERT INTO names VALUES('東京タワー'), ('京都タワー'), ('大阪城');
+
+-- 1|東京タワー|0.857142857142857
+SELECT doc, value, score FROM ngram_similar('names', '東京タワ', 0.5);
+
+-- An exact copy of a value scores 1.0, also when the run ends in a window shorter than gram
+CREATE VIRTUAL TABLE t3 USING fts5(x, tokenize = 'ngram gram 3');
+INSERT INTO t3 VALUES('ab世界'), ('ab世');
+SELECT doc, value, score FROM ngram_similar('t3', 'ab世界', 1.0);
+SELECT doc, value, score FROM ngram_similar('t3', 'ab世界', 0.9, 'jaccard');
+
+-- Names are matched without case and may be qualified by an attached schema, the schema is never changed
+ATTACH ':memory:' AS aux;
+CREATE VIRTUAL TABLE aux.spots USING fts5(name, note, tokenize = 'ngram gram 2');
+INSERT INTO aux.spots VALUES('東京駅', '丸の内'), ('新宿駅', '東京タワー');
+PRAGMA schema_version;
+-- 2|note|東京タワー|1.0
+SELECT doc, col, value, score FROM ngram_similar('AUX.Spots', '東京タワー', 0.5);
+-- 1|東京タワー
+-- 2|京都タワー
+SELECT doc, value FROM ngram_similar('Names', '東京タワー', 0.5);
+-- the same schema_version as above, and 0
+PRAGMA schema_version;
+SELECT count(*) FROM temp.sqlite_master;
@@ -0,0 +1,11 @@
+.load build/libngram.so sqlite3_ngram_tools_init
+
+SELECT * FROM ngram_tokens('Hello世界', 'gram 2');
+SELECT group_concat(token, ' ') FROM ngram_tokens('東京タワー', 'gram 3 case_sensitive');
+
+-- More option strings than cached tokenizers, with cursors of evicted ones still open
+WITH o(opt) AS (VALUES ('query_cache 0'), ('query_cache 1'), ('query_cache 2'), ('query_cache 3'), ('query_cache 4'),
+                       ('query_cache 5'), ('query_cache 6'), ('query_cache 7'), ('query_cache 8'), ('query_cache 9'),
+                       ('query_cache 10'), ('query_cache 11'), ('query_cache 12'), ('query_cache 13'), ('query_cache 14'),
+                       ('query_cache 15'), ('query_cache 16'), ('query_cache 17'), ('query_cache 18'), ('query_cache 19'))
+SELECT count(*) FROM ngram_tokens('東京都庁舎', 'gram 2') a, o, ngram_tokens('xy', o.opt) b;
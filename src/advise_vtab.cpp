@@ -0,0 +1,615 @@
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <new>
+#include <set>
+#include <system_error>
+#include <thread>
+#ifndef DROMOZOA_NO_GOOGLE_LOGGING
+#include <glog/logging.h>
+#else
+#include "common.hpp"
+#endif
+
+#include "advise_vtab.h"
+#include "tokenizer.h"
+#include "utils.h"
+
+SQLITE_EXTENSION_INIT3
+
+// see:
+//  https://sqlite.org/vtab.html#eponymous_only_virtual_tables
+//  https://sqlite.org/fts5.html#fts5_data_structures
+
+#define ADVISE_COLUMN_CONFIG            0
+#define ADVISE_COLUMN_SAMPLE_ROWS       1
+#define ADVISE_COLUMN_TOTAL_ROWS        2
+#define ADVISE_COLUMN_SAMPLE_DISTINCT_TERMS 3
+#define ADVISE_COLUMN_POSTINGS          4
+#define ADVISE_COLUMN_INDEX_BYTES       5
+#define ADVISE_COLUMN_AVG_DOCLIST       6
+#define ADVISE_COLUMN_QUERY_COST        7
+#define ADVISE_COLUMN_SOURCE            8
+#define ADVISE_COLUMN_SOURCE_COLUMN     9
+#define ADVISE_COLUMN_CONFIGS           10
+#define ADVISE_COLUMN_SAMPLE            11
+#define ADVISE_COLUMN_QUERY_LEN         12
+#define ADVISE_ARGS                     5
+
+#define DEFAULT_CONFIGS     "gram 1; gram 2; gram 3; gram 4"
+#define DEFAULT_SAMPLE      1000
+#define DEFAULT_QUERY_LEN   4
+
+// Random rowids tried per sampled row, rowids that hit a gap or a picked row are tried again
+#define SAMPLE_ATTEMPTS     4
+
+/*
+ * Rough on-disk cost of the FTS5 index, a term is stored once in the leaf pages with prefix compression
+ *  and its doclist holds a rowid delta and a position list size per row, then a varint per position.
+ */
+#define TERM_OVERHEAD_BYTES     4
+#define POSTING_BYTES           3
+#define POSITION_BYTES          1
+
+typedef struct {
+    sqlite3_int64 docs;         /* Sampled rows containing the term */
+    sqlite3_int64 hits;         /* Occurrences in the sampled rows */
+    sqlite3_int64 last_row;
+} term_stat_t;
+
+typedef std::map<
+        ngram_tokenizer::String,
+        term_stat_t,
+        std::less<ngram_tokenizer::String>,
+        ngram_tokenizer::Allocator<std::pair<const ngram_tokenizer::String, term_stat_t>>
+> term_map_t;
+
+typedef struct {
+    ngram_tokenizer::String config;
+    Fts5Tokenizer *pTok;
+    int rc;
+    sqlite3_int64 distinct_terms;
+    sqlite3_int64 postings;
+    sqlite3_int64 hits;
+    sqlite3_int64 term_bytes;
+    double query_cost;
+} advise_row_t;
+
+typedef struct {
+    sqlite3_vtab base;
+    sqlite3 *db;
+    fts5_api *pFts5Api;
+} advise_vtab;
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    ngram_tokenizer::Vector<advise_row_t> rows;
+    sqlite3_int64 sample_rows;
+    sqlite3_int64 total_rows;
+    size_t i;
+} advise_cursor;
+
+typedef struct {
+    term_map_t *terms;
+    sqlite3_int64 row;
+    double cost;
+} advise_token_ctx_t;
+
+static void advise_error(sqlite3_vtab *pVtab, const char *zFormat, const char *zArg) {
+    sqlite3_free(pVtab->zErrMsg);
+    pVtab->zErrMsg = sqlite3_mprintf(zFormat, zArg);
+}
+
+static int advise_connect(
+        sqlite3 *db,
+        void *pAux,
+        int argc,
+        const char *const *argv,
+        sqlite3_vtab **ppVtab,
+        char **pzErr) {
+    UNUSED(argc);
+    UNUSED(argv, pzErr);
+
+    int rc = sqlite3_declare_vtab(
+            db, "CREATE TABLE x(config, sample_rows, total_rows, sample_distinct_terms, postings, index_bytes, "
+                "avg_doclist, query_cost, "
+                "source HIDDEN, source_column HIDDEN, configs HIDDEN, sample HIDDEN, query_len HIDDEN)");
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+
+    void *mem = sqlite3_malloc(sizeof(advise_vtab));
+    if (mem == nullptr) {
+        return SQLITE_NOMEM;
+    }
+    auto *vtab = new(mem) advise_vtab();
+    vtab->db = db;
+    vtab->pFts5Api = (fts5_api *) pAux;
+    // Reads arbitrary tables of the connection, keep it out of triggers and views
+    sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+
+    *ppVtab = &vtab->base;
+    return SQLITE_OK;
+}
+
+static int advise_disconnect(sqlite3_vtab *pVtab) {
+    auto *vtab = (advise_vtab *) pVtab;
+    vtab->~advise_vtab();
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+static int advise_best_index(sqlite3_vtab *pVtab, sqlite3_index_info *pInfo) {
+    UNUSED(pVtab);
+
+    // Bit i of idxNum tells the i-th argument is given, they are passed to xFilter() in column order
+    int aIdx[ADVISE_ARGS] = {-1, -1, -1, -1, -1};
+    for (int i = 0; i < pInfo->nConstraint; i++) {
+        const auto &c = pInfo->aConstraint[i];
+        if (c.op != SQLITE_INDEX_CONSTRAINT_EQ || c.iColumn < ADVISE_COLUMN_SOURCE) {
+            continue;
+        }
+        if (!c.usable) {
+            return SQLITE_CONSTRAINT;
+        }
+        aIdx[c.iColumn - ADVISE_COLUMN_SOURCE] = i;
+    }
+
+    int argvIndex = 0;
+    pInfo->idxNum = 0;
+    for (int i = 0; i < ADVISE_ARGS; i++) {
+        if (aIdx[i] >= 0) {
+            pInfo->idxNum |= 1 << i;
+            pInfo->aConstraintUsage[aIdx[i]].argvIndex = ++argvIndex;
+            pInfo->aConstraintUsage[aIdx[i]].omit = 1;
+        }
+    }
+    pInfo->estimatedCost = 1e6;
+    pInfo->estimatedRows = 4;
+    return SQLITE_OK;
+}
+
+static int advise_open(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor) {
+    UNUSED(pVtab);
+
+    void *mem = sqlite3_malloc(sizeof(advise_cursor));
+    if (mem == nullptr) {
+        return SQLITE_NOMEM;
+    }
+    auto *cur = new(mem) advise_cursor{};
+
+    *ppCursor = &cur->base;
+    return SQLITE_OK;
+}
+
+static void advise_release(advise_cursor *cur) {
+    for (auto &row: cur->rows) {
+        if (row.pTok != nullptr) {
+            ngram_cb_delete(row.pTok);
+        }
+    }
+    cur->rows.clear();
+}
+
+static int advise_close(sqlite3_vtab_cursor *pCursor) {
+    auto *cur = (advise_cursor *) pCursor;
+    advise_release(cur);
+    cur->~advise_cursor();
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+static int advise_count_cb(void *pCtx, int tflags, const char *pToken, int nToken, int iStart, int iEnd) {
+    UNUSED(tflags);
+    UNUSED(iStart, iEnd);
+
+    auto *tc = (advise_token_ctx_t *) pCtx;
+    auto &stat = (*tc->terms)[ngram_tokenizer::String(pToken, nToken)];
+    if (stat.docs == 0 || stat.last_row != tc->row) {
+        stat.docs++;
+        stat.last_row = tc->row;
+    }
+    stat.hits++;
+    return SQLITE_OK;
+}
+
+static int advise_query_cb(void *pCtx, int tflags, const char *pToken, int nToken, int iStart, int iEnd) {
+    UNUSED(tflags);
+    UNUSED(iStart, iEnd);
+
+    // A phrase query reads the whole doclist of each of its terms
+    auto *tc = (advise_token_ctx_t *) pCtx;
+    auto found = tc->terms->find(ngram_tokenizer::String(pToken, nToken));
+    if (found != tc->terms->end()) {
+        tc->cost += (double) found->second.docs;
+    }
+    return SQLITE_OK;
+}
+
+/**
+ * Byte range of the query_len characters in the middle of text, a stand-in for a typical query
+ *
+ * @return  false if the text is shorter than query_len characters
+ */
+static bool middle_chars(const ngram_tokenizer::String &text, int query_len, size_t *pStart, size_t *pEnd) {
+    ngram_tokenizer::Vector<size_t> offsets;
+    for (size_t i = 0; i < text.size();) {
+        size_t len;
+        ngram_tokenizer::utf8_decode(text.data() + i, text.size() - i, &len);
+        offsets.push_back(i);
+        i += len;
+    }
+    offsets.push_back(text.size());
+
+    size_t nChars = offsets.size() - 1;
+    if (nChars < (size_t) query_len) {
+        return false;
+    }
+    size_t first = (nChars - query_len) / 2;
+    *pStart = offsets[first];
+    *pEnd = offsets[first + query_len];
+    return true;
+}
+
+/**
+ * Tokenize every sampled row under one config, runs on a worker thread
+ *  The tokenizer instance is owned by the row, so nothing is shared but the read-only samples.
+ */
+static void advise_run(advise_row_t *row, const ngram_tokenizer::Vector<ngram_tokenizer::String> &samples,
+                       int query_len) {
+    try {
+        term_map_t terms;
+        advise_token_ctx_t tc{&terms, 0, 0};
+        for (const auto &text: samples) {
+            row->rc = ngram_cb_tokenize(row->pTok, &tc, FTS5_TOKENIZE_DOCUMENT,
+                                        text.data(), (int) text.size(), advise_count_cb);
+            if (row->rc != SQLITE_OK) {
+                return;
+            }
+            tc.row++;
+        }
+
+        for (const auto &e: terms) {
+            row->distinct_terms++;
+            row->postings += e.second.docs;
+            row->hits += e.second.hits;
+            row->term_bytes += (sqlite3_int64) e.first.size() + TERM_OVERHEAD_BYTES;
+        }
+
+        sqlite3_int64 nQuery = 0;
+        for (const auto &text: samples) {
+            size_t iStart, iEnd;
+            if (!middle_chars(text, query_len, &iStart, &iEnd)) {
+                continue;
+            }
+            row->rc = ngram_cb_tokenize(row->pTok, &tc, FTS5_TOKENIZE_QUERY,
+                                        text.data() + iStart, (int) (iEnd - iStart), advise_query_cb);
+            if (row->rc != SQLITE_OK) {
+                return;
+            }
+            nQuery++;
+        }
+        row->query_cost = nQuery > 0 ? tc.cost / (double) nQuery : 0;
+    } catch (const std::bad_alloc &) {
+        row->rc = SQLITE_NOMEM;
+    }
+}
+
+// Value of a sampled row, invalid UTF-8 is skipped as the tokenizer would reject it
+static void advise_add_sample(sqlite3_stmt *pStmt, int iCol, ngram_tokenizer::Vector<ngram_tokenizer::String> &samples) {
+    auto p = (const char *) sqlite3_column_text(pStmt, iCol);
+    int n = sqlite3_column_bytes(pStmt, iCol);
+    if (ngram_tokenizer::utf8_validatestr(reinterpret_cast<const u_int8_t *>(p), n) != 0) {
+        return;
+    }
+    samples.emplace_back(p, n);
+}
+
+static int advise_prepare(advise_vtab *vtab, char *zSql, sqlite3_stmt **ppStmt, bool report) {
+    if (zSql == nullptr) {
+        return SQLITE_NOMEM;
+    }
+    int rc = sqlite3_prepare_v2(vtab->db, zSql, -1, ppStmt, nullptr);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK && report) {
+        advise_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+    }
+    return rc;
+}
+
+static int advise_finalize(advise_vtab *vtab, sqlite3_stmt *pStmt, int rc) {
+    if (rc != SQLITE_DONE && rc != SQLITE_ROW && rc != SQLITE_OK) {
+        advise_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+        sqlite3_finalize(pStmt);
+        return rc;
+    }
+    return sqlite3_finalize(pStmt);
+}
+
+/**
+ * Whole table sample of views and WITHOUT ROWID tables, which have no rowid to pick rows by
+ *  Column names are qualified, a double-quoted unknown name would otherwise turn into a string literal.
+ */
+static int advise_sample_sorted(advise_vtab *vtab, advise_cursor *cur, const char *zSource, const char *zColumn,
+                                int nSample, ngram_tokenizer::Vector<ngram_tokenizer::String> &samples) {
+    sqlite3_stmt *pStmt = nullptr;
+    int rc = advise_prepare(vtab, sqlite3_mprintf(
+            "SELECT (SELECT count(\"%w\") FROM \"%w\"), \"%w\".\"%w\" FROM \"%w\" "
+            "WHERE \"%w\".\"%w\" IS NOT NULL ORDER BY random() LIMIT %d",
+            zColumn, zSource, zSource, zColumn, zSource, zSource, zColumn, nSample), &pStmt, true);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    while ((rc = sqlite3_step(pStmt)) == SQLITE_ROW) {
+        cur->total_rows = sqlite3_column_int64(pStmt, 0);
+        advise_add_sample(pStmt, 1, samples);
+    }
+    return advise_finalize(vtab, pStmt, rc);
+}
+
+/**
+ * Read the row count and a random sample of the source column
+ *  Rows are picked by random rowids between the smallest and the largest one, each one a lookup,
+ *  thus a large table is neither read nor sorted as a whole. The count of non-NULL values is
+ *  estimated from the picked rows, the row count itself is counted on the b-tree without reading rows.
+ */
+static int advise_sample(advise_vtab *vtab, advise_cursor *cur, const char *zSource, const char *zColumn, int nSample,
+                         ngram_tokenizer::Vector<ngram_tokenizer::String> &samples) {
+    sqlite3_stmt *pStmt = nullptr;
+    int rc = advise_prepare(vtab, sqlite3_mprintf("SELECT min(rowid), max(rowid) FROM \"%w\"", zSource),
+                            &pStmt, false);
+    if (rc != SQLITE_OK) {
+        return advise_sample_sorted(vtab, cur, zSource, zColumn, nSample, samples);
+    }
+    // An empty table has no rowid range either, and the rowid of a view reads as NULL
+    bool ranged = false;
+    sqlite3_int64 iMin = 0, iMax = 0;
+    rc = sqlite3_step(pStmt);
+    if (rc == SQLITE_ROW && sqlite3_column_type(pStmt, 0) != SQLITE_NULL) {
+        ranged = true;
+        iMin = sqlite3_column_int64(pStmt, 0);
+        iMax = sqlite3_column_int64(pStmt, 1);
+    }
+    rc = advise_finalize(vtab, pStmt, rc);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    if (!ranged) {
+        return advise_sample_sorted(vtab, cur, zSource, zColumn, nSample, samples);
+    }
+
+    rc = advise_prepare(vtab, sqlite3_mprintf("SELECT count(*) FROM \"%w\"", zSource), &pStmt, true);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    sqlite3_int64 nRows = 0;
+    rc = sqlite3_step(pStmt);
+    if (rc == SQLITE_ROW) {
+        nRows = sqlite3_column_int64(pStmt, 0);
+    }
+    rc = advise_finalize(vtab, pStmt, rc);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+
+    // A small table is read as a whole
+    if (nRows <= nSample) {
+        rc = advise_prepare(vtab, sqlite3_mprintf("SELECT \"%w\".\"%w\" FROM \"%w\" WHERE \"%w\".\"%w\" IS NOT NULL",
+                                                  zSource, zColumn, zSource, zSource, zColumn), &pStmt, true);
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+        while ((rc = sqlite3_step(pStmt)) == SQLITE_ROW) {
+            cur->total_rows++;
+            advise_add_sample(pStmt, 0, samples);
+        }
+        return advise_finalize(vtab, pStmt, rc);
+    }
+
+    rc = advise_prepare(vtab, sqlite3_mprintf("SELECT rowid, \"%w\".\"%w\" FROM \"%w\" WHERE rowid >= ?1 ORDER BY rowid LIMIT 1",
+                                              zSource, zColumn, zSource), &pStmt, true);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    // Rows after a gap of rowids are picked more often, good enough for an estimate
+    std::set<sqlite3_int64, std::less<sqlite3_int64>, ngram_tokenizer::Allocator<sqlite3_int64>> seen;
+    sqlite3_int64 nPicked = 0, nValues = 0;
+    auto range = (uint64_t) iMax - (uint64_t) iMin + 1;
+    for (int attempt = 0; attempt < nSample * SAMPLE_ATTEMPTS && nValues < nSample; attempt++) {
+        uint64_t r;
+        sqlite3_randomness(sizeof(r), &r);
+        sqlite3_bind_int64(pStmt, 1, (sqlite3_int64) ((uint64_t) iMin + (range != 0 ? r % range : r)));
+        rc = sqlite3_step(pStmt);
+        if (rc == SQLITE_ROW && seen.insert(sqlite3_column_int64(pStmt, 0)).second) {
+            nPicked++;
+            if (sqlite3_column_type(pStmt, 1) != SQLITE_NULL) {
+                nValues++;
+                advise_add_sample(pStmt, 1, samples);
+            }
+        }
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+            return advise_finalize(vtab, pStmt, rc);
+        }
+        sqlite3_reset(pStmt);
+    }
+    cur->total_rows = nPicked > 0 ? (sqlite3_int64) ((double) nRows * nValues / nPicked + 0.5) : 0;
+    return advise_finalize(vtab, pStmt, SQLITE_OK);
+}
+
+static int advise_filter(
+        sqlite3_vtab_cursor *pCursor,
+        int idxNum,
+        const char *idxStr,
+        int argc,
+        sqlite3_value **argv) {
+    UNUSED(idxStr, argc);
+
+    auto *cur = (advise_cursor *) pCursor;
+    auto *vtab = (advise_vtab *) pCursor->pVtab;
+    advise_release(cur);
+    cur->i = 0;
+    cur->sample_rows = 0;
+    cur->total_rows = 0;
+
+    sqlite3_value *apArg[ADVISE_ARGS] = {};
+    for (int i = 0, j = 0; i < ADVISE_ARGS; i++) {
+        if (idxNum & (1 << i)) {
+            apArg[i] = argv[j++];
+        }
+    }
+    auto zSource = (const char *) (apArg[0] ? sqlite3_value_text(apArg[0]) : nullptr);
+    auto zColumn = (const char *) (apArg[1] ? sqlite3_value_text(apArg[1]) : nullptr);
+    auto zConfigs = (const char *) (apArg[2] ? sqlite3_value_text(apArg[2]) : nullptr);
+    int nSample = apArg[3] ? sqlite3_value_int(apArg[3]) : DEFAULT_SAMPLE;
+    int query_len = apArg[4] ? sqlite3_value_int(apArg[4]) : DEFAULT_QUERY_LEN;
+    if (zSource == nullptr || zColumn == nullptr) {
+        advise_error(&vtab->base, "%s", LIBNAME "_advise() expected a source table and column");
+        return SQLITE_ERROR;
+    }
+    if (zConfigs == nullptr) zConfigs = DEFAULT_CONFIGS;
+    if (nSample <= 0) nSample = DEFAULT_SAMPLE;
+    if (query_len <= 0) query_len = DEFAULT_QUERY_LEN;
+
+    try {
+        // Create the tokenizers up front, option errors are reported before any work is done
+        for (const auto &config: ngram_tokenizer::split(zConfigs, ';')) {
+            auto options = ngram_tokenizer::trim(config);
+            if (options.empty()) {
+                continue;
+            }
+            advise_row_t row{};
+            row.config.assign(options.data(), options.size());
+            int rc = ngram_cb_create_options(vtab->pFts5Api, options.c_str(), &row.pTok);
+            if (rc != SQLITE_OK) {
+                advise_error(&vtab->base, "invalid " LIBNAME " tokenizer options: %s", options.c_str());
+                return rc;
+            }
+            cur->rows.push_back(row);
+        }
+
+        ngram_tokenizer::Vector<ngram_tokenizer::String> samples;
+        int rc = advise_sample(vtab, cur, zSource, zColumn, nSample, samples);
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+        cur->sample_rows = (sqlite3_int64) samples.size();
+
+        // One config per task, the calling thread takes tasks too
+        std::atomic<size_t> next(0);
+        auto worker = [&]() {
+            size_t i;
+            while ((i = next++) < cur->rows.size()) {
+                advise_run(&cur->rows[i], samples, query_len);
+            }
+        };
+        size_t nThread = 0;
+        if (sqlite3_threadsafe()) {
+            nThread = std::min<size_t>(cur->rows.size(), std::max(1u, std::thread::hardware_concurrency())) - 1;
+        }
+        // Reserved up front, a reallocation failing after some threads started would drop joinable threads
+        ngram_tokenizer::Vector<std::thread> threads;
+        threads.reserve(nThread);
+        for (size_t i = 0; i < nThread; i++) {
+            try {
+                threads.emplace_back(worker);
+            } catch (const std::system_error &e) {
+                LOG(ERROR) << "Cannot start an advise worker: " << e.what();
+                break;
+            }
+        }
+        worker();
+        for (auto &t: threads) {
+            t.join();
+        }
+
+        for (const auto &row: cur->rows) {
+            if (row.rc != SQLITE_OK) {
+                advise_error(&vtab->base, "cannot tokenize the samples with options: %s", row.config.c_str());
+                return row.rc;
+            }
+        }
+        return SQLITE_OK;
+    } catch (const std::bad_alloc &) {
+        return SQLITE_NOMEM;
+    }
+}
+
+static int advise_next(sqlite3_vtab_cursor *pCursor) {
+    ((advise_cursor *) pCursor)->i++;
+    return SQLITE_OK;
+}
+
+static int advise_eof(sqlite3_vtab_cursor *pCursor) {
+    auto *cur = (advise_cursor *) pCursor;
+    return cur->i >= cur->rows.size();
+}
+
+static int advise_column(sqlite3_vtab_cursor *pCursor, sqlite3_context *pCtx, int i) {
+    auto *cur = (advise_cursor *) pCursor;
+    const auto &row = cur->rows[cur->i];
+    // Counts of the sample are scaled up to the whole table, except distinct terms which grow sublinearly
+    double scale = cur->sample_rows > 0 ? (double) cur->total_rows / (double) cur->sample_rows : 0;
+    switch (i) {
+        case ADVISE_COLUMN_CONFIG:
+            sqlite3_result_text(pCtx, row.config.data(), (int) row.config.size(), SQLITE_TRANSIENT);
+            break;
+        case ADVISE_COLUMN_SAMPLE_ROWS:
+            sqlite3_result_int64(pCtx, cur->sample_rows);
+            break;
+        case ADVISE_COLUMN_TOTAL_ROWS:
+            sqlite3_result_int64(pCtx, cur->total_rows);
+            break;
+        case ADVISE_COLUMN_SAMPLE_DISTINCT_TERMS:
+            sqlite3_result_int64(pCtx, row.distinct_terms);
+            break;
+        case ADVISE_COLUMN_POSTINGS:
+            sqlite3_result_int64(pCtx, (sqlite3_int64) ((double) row.postings * scale));
+            break;
+        case ADVISE_COLUMN_INDEX_BYTES:
+            sqlite3_result_int64(pCtx, row.term_bytes + (sqlite3_int64) (
+                    ((double) row.postings * POSTING_BYTES + (double) row.hits * POSITION_BYTES) * scale));
+            break;
+        case ADVISE_COLUMN_AVG_DOCLIST:
+            sqlite3_result_double(
+                    pCtx, row.distinct_terms > 0 ? (double) row.postings * scale / (double) row.distinct_terms : 0);
+            break;
+        case ADVISE_COLUMN_QUERY_COST:
+            sqlite3_result_double(pCtx, row.query_cost * scale);
+            break;
+        default:
+            // Hidden columns are consumed by xFilter()
+            sqlite3_result_null(pCtx);
+            break;
+    }
+    return SQLITE_OK;
+}
+
+static int advise_rowid(sqlite3_vtab_cursor *pCursor, sqlite_int64 *pRowid) {
+    *pRowid = (sqlite_int64) ((advise_cursor *) pCursor)->i + 1;
+    return SQLITE_OK;
+}
+
+// Fields are assigned by name, the struct grows with SQLite versions
+static sqlite3_module make_advise_module() {
+    sqlite3_module m{};
+    m.iVersion = 0;
+    m.xCreate = nullptr;        /* Eponymous-only */
+    m.xConnect = advise_connect;
+    m.xBestIndex = advise_best_index;
+    m.xDisconnect = advise_disconnect;
+    m.xOpen = advise_open;
+    m.xClose = advise_close;
+    m.xFilter = advise_filter;
+    m.xNext = advise_next;
+    m.xEof = advise_eof;
+    m.xColumn = advise_column;
+    m.xRowid = advise_rowid;
+    return m;
+}
+
+static const sqlite3_module advise_module = make_advise_module();
+
+int ngram_advise_register(sqlite3 *db, fts5_api *pFts5Api) {
+    return sqlite3_create_module(db, LIBNAME "_advise", &advise_module, pFts5Api);
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "sqlite3ext.h"
+
+/*
+ * ngram_advise(source, source_column, configs, sample, query_len)
+ *  Eponymous table-valued function sampling a table and estimating the index size per tokenizer config.
+ */
+int ngram_advise_register(sqlite3 *db, fts5_api *pFts5Api);
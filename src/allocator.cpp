@@ -0,0 +1,26 @@
+#include "allocator.h"
+
+#include <cstdlib>
+#include <new>
+
+namespace ngram_tokenizer {
+    static mem_alloc_hook_t alloc_hook = std::malloc;
+    static mem_free_hook_t free_hook = std::free;
+
+    void set_mem_hooks(mem_alloc_hook_t alloc, mem_free_hook_t free) {
+        alloc_hook = alloc;
+        free_hook = free;
+    }
+
+    void *mem_alloc(size_t n) {
+        void *p = alloc_hook(n);
+        if (p == nullptr && n != 0) {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+
+    void mem_free(void *p) {
+        free_hook(p);
+    }
+}
@@ -0,0 +1,61 @@
+/**
+ * STL allocator backed by replaceable hooks, malloc(3) by default.
+ *  The SQLite extension routes them to sqlite3_malloc64(), so the working memory of the tokenizer
+ *  shows up in sqlite3_memory_used() and is bounded by sqlite3_soft_heap_limit64()/sqlite3_hard_heap_limit64().
+ *
+ * see: LICENSE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace ngram_tokenizer {
+    typedef void *(*mem_alloc_hook_t)(size_t);
+
+    typedef void (*mem_free_hook_t)(void *);
+
+    // Call once before anything is allocated, memory must be freed by the hook that allocated it
+    void set_mem_hooks(mem_alloc_hook_t, mem_free_hook_t);
+
+    // Throw std::bad_alloc on failure, callers at the C boundary translate it into an error code
+    void *mem_alloc(size_t);
+
+    void mem_free(void *);
+
+    template<typename T>
+    class Allocator {
+    public:
+        typedef T value_type;
+
+        Allocator() noexcept = default;
+
+        template<typename U>
+        Allocator(const Allocator<U> &) noexcept {}
+
+        T *allocate(size_t n) {
+            return static_cast<T *>(mem_alloc(n * sizeof(T)));
+        }
+
+        void deallocate(T *p, size_t) noexcept {
+            mem_free(p);
+        }
+    };
+
+    template<typename T, typename U>
+    inline bool operator==(const Allocator<T> &, const Allocator<U> &) noexcept {
+        return true;
+    }
+
+    template<typename T, typename U>
+    inline bool operator!=(const Allocator<T> &, const Allocator<U> &) noexcept {
+        return false;
+    }
+
+    typedef std::basic_string<char, std::char_traits<char>, Allocator<char>> String;
+
+    template<typename T>
+    using Vector = std::vector<T, Allocator<T>>;
+}
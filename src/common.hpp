@@ -6,7 +6,8 @@
 #include <iostream>
 #include <string>
 
-#define DLOG(key) stream_wrapper{nullptr}
+// Never evaluate the operands, like DLOG() of glog in release builds
+#define DLOG(key) while (false) stream_wrapper{nullptr}
 #define LOG(key) LOG_##key
 #define LOG_INFO stream_wrapper{&std::cout}
 #define LOG_ERROR stream_wrapper{&std::cerr}
@@ -52,6 +53,7 @@ private:
 #define CHECK_NE(a, b) assert((a) != (b))
 #define CHECK_LT(a, b) assert((a) < (b))
 #define CHECK_GE(a, b) assert((a) >= (b))
+#define CHECK_LE(a, b) assert((a) <= (b))
 
 namespace google {
   inline void InitGoogleLogging(const char*) {}
@@ -0,0 +1,126 @@
+#include "compact_term.h"
+
+#include <cstdint>
+
+#include "utils.h"
+
+namespace ngram_tokenizer {
+    /*
+     * Layout of a compact term:
+     *
+     *  0x01                    marker, ASCII terms only consist of [0x21, 0x7e]
+     *  [1, 249] [1, 255]       BMP code point, two base-255 digits
+     *  0xfa [1, 255] * 3       astral code point, marker plus three base-255 digits
+     *
+     * Digits are biased by one so a term never contains a NUL byte(the FTS5 query
+     *  parser treats terms as C strings), and they are big-endian so the byte order
+     *  of terms follows the code point order, thus prefix queries keep working.
+     */
+
+#define BMP_FIRST           0x80u
+#define SURROGATE_FIRST     0xD800u
+#define SURROGATE_COUNT     0x800u
+#define ASTRAL_FIRST        0x10000u
+#define ASTRAL_MARKER       0xFAu
+#define DIGIT_BASE          255u
+
+    static inline void utf8_encode(uint32_t c, String &out) {
+        if (c < 0x80) {
+            out += (char) c;
+        } else if (c < 0x800) {
+            out += (char) (0xC0 | (c >> 6));
+            out += (char) (0x80 | (c & 0x3F));
+        } else if (c < 0x10000) {
+            out += (char) (0xE0 | (c >> 12));
+            out += (char) (0x80 | ((c >> 6) & 0x3F));
+            out += (char) (0x80 | (c & 0x3F));
+        } else {
+            out += (char) (0xF0 | (c >> 18));
+            out += (char) (0x80 | ((c >> 12) & 0x3F));
+            out += (char) (0x80 | ((c >> 6) & 0x3F));
+            out += (char) (0x80 | (c & 0x3F));
+        }
+    }
+
+    bool is_compact_term(const char *p, size_t n) {
+        return n > 0 && (unsigned char) p[0] == COMPACT_TERM_MARKER;
+    }
+
+    /**
+     * Whether the compact form of an UTF-8 string is not longer than the string itself
+     *  A 3 byte character shrinks to 2 bytes and pays for the marker, every other character
+     *  keeps its length. 2 byte and astral characters would grow by the marker.
+     */
+    bool is_compact_worthy(const char *p, size_t n) {
+        return n >= 3 && ((unsigned char) p[0] & 0xF0u) == 0xE0u;
+    }
+
+    /**
+     * Append the compact form of an UTF-8 string to out
+     *  The input should be a valid UTF-8 string without ASCII characters.
+     */
+    void compact_encode(const char *p, size_t n, String &out) {
+        out += (char) COMPACT_TERM_MARKER;
+        while (n > 0) {
+            size_t len;
+            uint32_t c = utf8_decode(p, n, &len);
+            p += len;
+            n -= len;
+
+            if (c < ASTRAL_FIRST) {
+                uint32_t v = c - BMP_FIRST;
+                if (c >= SURROGATE_FIRST) v -= SURROGATE_COUNT;
+                out += (char) (1 + v / DIGIT_BASE);
+                out += (char) (1 + v % DIGIT_BASE);
+            } else {
+                uint32_t v = c - ASTRAL_FIRST;
+                out += (char) ASTRAL_MARKER;
+                out += (char) (1 + v / (DIGIT_BASE * DIGIT_BASE));
+                out += (char) (1 + v / DIGIT_BASE % DIGIT_BASE);
+                out += (char) (1 + v % DIGIT_BASE);
+            }
+        }
+    }
+
+    /**
+     * Append the UTF-8 form of a compact term to out
+     *
+     * @return  false if the input is not a well-formed compact term
+     */
+    bool compact_decode(const char *p, size_t n, String &out) {
+        auto s = (const unsigned char *) p;
+        if (!is_compact_term(p, n)) {
+            return false;
+        }
+        s++;
+        n--;
+
+        while (n > 0) {
+            uint32_t c;
+            if (s[0] == ASTRAL_MARKER) {
+                if (n < 4 || !s[1] || !s[2] || !s[3]) {
+                    return false;
+                }
+                c = ASTRAL_FIRST + ((s[1] - 1u) * DIGIT_BASE + (s[2] - 1u)) * DIGIT_BASE + (s[3] - 1u);
+                if (c > 0x10FFFF) {
+                    return false;
+                }
+                s += 4;
+                n -= 4;
+            } else {
+                if (n < 2 || !s[0] || !s[1] || s[0] > ASTRAL_MARKER) {
+                    return false;
+                }
+                c = BMP_FIRST + (s[0] - 1u) * DIGIT_BASE + (s[1] - 1u);
+                if (c >= SURROGATE_FIRST) c += SURROGATE_COUNT;
+                if (c >= ASTRAL_FIRST) {
+                    return false;
+                }
+                s += 2;
+                n -= 2;
+            }
+            utf8_encode(c, out);
+        }
+        return true;
+    }
+}
@@ -0,0 +1,24 @@
+/**
+ * Compact binary encoding of non-ASCII ngram terms
+ *
+ * see: LICENSE.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+#include "allocator.h"
+
+namespace ngram_tokenizer {
+    // First byte of every compact term, never produced by the ASCII token path
+    const unsigned char COMPACT_TERM_MARKER = 0x01;
+
+    bool is_compact_term(const char *, size_t);
+
+    bool is_compact_worthy(const char *, size_t);
+
+    void compact_encode(const char *, size_t, String &);
+
+    bool compact_decode(const char *, size_t, String &);
+}
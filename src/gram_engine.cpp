@@ -0,0 +1,93 @@
+#include "gram_engine.h"
+
+#include <string>
+#ifndef DROMOZOA_NO_GOOGLE_LOGGING
+#include <glog/logging.h>
+#else
+#include "common.hpp"
+#endif
+
+#include "gram_iterator.h"
+#include "utils.h"
+
+namespace ngram_tokenizer {
+    /**
+     * Emit the grams of size N, instantiated for each gram size so the window bounds are constants
+     */
+    template<int N>
+    static int emit_grams(
+            const GramOptions &options,
+            Scratch &scratch,
+            void *pCtx,
+            int flags,
+            const char *pText,
+            const Vector<Token> &tokens,
+            gram_callback_t xToken) {
+        GramState st;
+        st.reset(tokens, N, (flags & GRAM_QUERY) != 0, (flags & GRAM_PREFIX) != 0);
+        size_t first, last;
+        while (gram_next<N>(st, tokens, &first, &last)) {
+            const char *pGram;
+            int nGram;
+            build_gram(pText, tokens, first, last, options.case_sensitive, options.compact_terms,
+                       scratch, &pGram, &nGram);
+
+            int iStart = tokens[first].get_iStart();
+            int iEnd = tokens[last].get_iEnd();
+            DLOG(INFO) << "> result token = '" << std::string(pGram, nGram) << "'"
+                       << " iStart = " << iStart
+                       << " iEnd = " << iEnd;
+            int rc = xToken(pCtx, 0, pGram, nGram, iStart, iEnd);
+            if (rc != GRAM_OK) {
+                return rc;
+            }
+        }
+
+        return GRAM_OK;
+    }
+
+    static const gram_engine_t GRAM_ENGINES[MAX_GRAM + 1] = {
+            nullptr,
+            emit_grams<1>,
+            emit_grams<2>,
+            emit_grams<3>,
+            emit_grams<4>,
+    };
+
+    gram_engine_t gram_engine(int ngram) {
+        CHECK_GE(ngram, MIN_GRAM);
+        CHECK_LE(ngram, MAX_GRAM);
+        return GRAM_ENGINES[ngram];
+    }
+
+    int tokenize_text(
+            const GramOptions &options,
+            gram_engine_t engine,
+            Scratch &scratch,
+            void *pCtx,
+            int flags,
+            const char *pText,
+            int nText,
+            gram_callback_t xToken) {
+        DLOG(INFO) << options.ngram << "-gram tokenizing ...";
+        // [quote] ... pText may or may not be nul-terminated.
+        DLOG(INFO) << "nText: " << nText << " pText: " << std::string(pText, 0, nText);
+
+        if (utf8_validatestr(reinterpret_cast<const u_int8_t *>(pText), nText) != 0) {
+            return GRAM_INVALID_TEXT;
+        }
+
+        auto tv = TokenVector(pText, nText, scratch.tokens);
+        if (!tv.tokenize()) {
+            return GRAM_INVALID_TEXT;
+        }
+        for (const auto &t: tv.get_tokens()) {
+            DLOG(INFO) << "> token = '" << std::string(pText + t.get_iStart(), t.get_iEnd() - t.get_iStart())
+                       << "' iStart = " << t.get_iStart()
+                       << " iEnd = " << t.get_iEnd()
+                       << " category = " << t.get_category();
+        }
+
+        return engine(options, scratch, pCtx, flags, pText, tv.get_tokens(), xToken);
+    }
+}
@@ -0,0 +1,69 @@
+/**
+ * Gram engine without any SQLite dependency, shared by the FTS5 tokenizer and libngram_core
+ *
+ * see: LICENSE.
+ */
+
+#pragma once
+
+#include "allocator.h"
+#include "scratch.h"
+#include "token_vector.h"
+
+#define MIN_GRAM        1   /* Essentially strstr(3) */
+#define MAX_GRAM        4
+#define DEFAULT_GRAM    2
+
+// Return codes of the engine, any other non-zero value comes from the callback
+#define GRAM_OK             0
+#define GRAM_INVALID_TEXT   (-1)
+
+// Flags of a text tokenized as a query rather than a document, and as a prefix query
+#define GRAM_QUERY          0x0001
+#define GRAM_PREFIX         0x0002
+
+namespace ngram_tokenizer {
+    struct GramOptions {
+        int ngram;
+        bool case_sensitive;
+        bool compact_terms;
+    };
+
+    // Same shape as the xToken callback of FTS5, a non-zero return stops the walk
+    typedef int (*gram_callback_t)(
+            void *pCtx,
+            int tflags,
+            const char *pToken,
+            int nToken,
+            int iStart,
+            int iEnd);
+
+    // Gram emitter specialized for one gram size
+    typedef int (*gram_engine_t)(
+            const GramOptions &,
+            Scratch &,
+            void *pCtx,
+            int flags,
+            const char *pText,
+            const Vector<Token> &,
+            gram_callback_t);
+
+    // The instantiation of the gram size, which should be in [MIN_GRAM, MAX_GRAM]
+    gram_engine_t gram_engine(int ngram);
+
+    /**
+     * Validate and segment the text, then emit its grams through the callback
+     *
+     * @param flags     GRAM_QUERY, optionally with GRAM_PREFIX, or 0
+     * @return  GRAM_OK, GRAM_INVALID_TEXT if the text is not valid UTF-8, or the non-zero return of the callback
+     */
+    int tokenize_text(
+            const GramOptions &,
+            gram_engine_t,
+            Scratch &,
+            void *pCtx,
+            int flags,
+            const char *pText,
+            int nText,
+            gram_callback_t);
+}
@@ -0,0 +1,100 @@
+#include "gram_iterator.h"
+
+#include <algorithm>
+#include <cctype>
+#ifndef DROMOZOA_NO_GOOGLE_LOGGING
+#include <glog/logging.h>
+#else
+#include "common.hpp"
+#endif
+
+#include "compact_term.h"
+
+namespace ngram_tokenizer {
+    void GramState::reset(const Vector<Token> &tokens, int ngram, bool for_query, bool for_prefix) {
+        query = for_query;
+        prefix_query = for_prefix;
+        i = 0;
+        len = 0;
+        prefixes = false;
+        u = 0;
+        prefixed_run = false;
+
+        // Computed once here rather than for every window near the end of the text
+        tail_drop = false;
+        if (tokens.size() >= (size_t) ngram) {
+            tail_drop = true;
+            token_category_t category = tokens.back().get_category();
+            for (int k = 1; k < ngram; k++) {
+                if (tokens[tokens.size() - k - 1].get_category() != category) {
+                    tail_drop = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    static const GramIterator::next_fn_t NEXT_FNS[] = {
+            nullptr,
+            gram_next<1>,
+            gram_next<2>,
+            gram_next<3>,
+            gram_next<4>,
+    };
+
+    GramIterator::GramIterator() : tokens(nullptr), next_fn(nullptr), state() {
+    }
+
+    GramIterator::GramIterator(const Vector<Token> &tokens, int ngram) : tokens(&tokens), next_fn(nullptr), state() {
+        CHECK_GE(ngram, 1);
+        CHECK_LT(ngram, (int) (sizeof(NEXT_FNS) / sizeof(NEXT_FNS[0])));
+        next_fn = NEXT_FNS[ngram];
+        state.reset(tokens, ngram, false, false);
+    }
+
+    bool GramIterator::next(size_t *first, size_t *last) {
+        if (tokens == nullptr) {
+            return false;
+        }
+        return next_fn(state, *tokens, first, last);
+    }
+
+    void build_gram(
+            const char *pText,
+            const Vector<Token> &tokens,
+            size_t first,
+            size_t last,
+            bool case_sensitive,
+            bool compact_terms,
+            Scratch &scratch,
+            const char **ppGram,
+            int *pnGram) {
+        CHECK_LT(tokens[first].get_iStart(), tokens[last].get_iEnd());
+
+        // Tokens may be apart from each other(separated by spaces), thus copy them one by one
+        String &s = scratch.gram;
+        s.clear();
+        for (size_t i = first; i <= last; i++) {
+            s.append(pText + tokens[i].get_iStart(), tokens[i].get_iEnd() - tokens[i].get_iStart());
+        }
+
+        if (!case_sensitive) {
+            // https://stackoverflow.com/questions/313970/how-to-convert-an-instance-of-stdstring-to-lower-case/313990#313990
+            std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+        }
+
+        // Grams starting with a 3 byte character only(most of CJK), the compact form of them is never longer.
+        //  The decision depends on the first character alone, so a prefix query is encoded as the grams it matches.
+        if (compact_terms && tokens[first].get_category() == OTHER && is_compact_worthy(s.data(), s.length())) {
+            String &compact = scratch.fold;
+            compact.clear();
+            compact_encode(s.data(), s.length(), compact);
+            *ppGram = compact.data();
+            *pnGram = (int) compact.length();
+            return;
+        }
+
+        *ppGram = s.data();
+        *pnGram = (int) s.length();
+    }
+}
@@ -0,0 +1,142 @@
+/**
+ * Pull-based gram engine shared by the FTS5 tokenizer and ngram_tokens()
+ *
+ * see: LICENSE.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+#include "allocator.h"
+#include "scratch.h"
+#include "token_vector.h"
+
+namespace ngram_tokenizer {
+    /**
+     * Where a walk over the grams of a token vector is, the same for every gram size
+     */
+    struct GramState {
+        void reset(const Vector<Token> &, int, bool, bool);
+
+        size_t i;                   /* Start of the current window */
+        size_t len;                 /* Length of the current window, 0 if not computed yet */
+        bool prefixes;              /* Emitting the prefixes of the current window */
+        size_t u;                   /* Length of the next prefix minus one */
+        bool prefixed_run;          /* The current run of OTHER tokens started with prefixes */
+        bool query;                 /* Walking a query rather than a document */
+        bool prefix_query;          /* The last gram of the query is matched as a prefix */
+        bool tail_drop;             /* The last N tokens share a category, see gram_window() */
+    };
+
+    /**
+     * Length of the window of N tokens starting at tokens[i], 0 if it should not be emitted
+     *  Only a run of OTHER tokens makes a window longer than one token. A window cut short
+     *  by the end of the text is dropped if tail_drop is set, when the previous windows
+     *  already covered it, see GramState::tail_drop and gram_next().
+     */
+    template<int N>
+    inline size_t gram_window(const Vector<Token> &tokens, size_t i, bool tail_drop) {
+        size_t len = 1;
+        bool other = tokens[i].get_category() == OTHER;
+        // The bound is a constant, the loop is unrolled for each N
+        for (int j = 1; j < N; j++) {
+            if (i + j >= tokens.size()) {
+                return tail_drop ? 0 : len;
+            }
+            if (!other || tokens[i + j].get_category() != OTHER) {
+                return len;
+            }
+            len++;
+        }
+        return len;
+    }
+
+    /**
+     * Step to the next gram of size N
+     *
+     * @return  false if there is no more gram, otherwise the gram is tokens[*first, *last]
+     */
+    template<int N>
+    inline bool gram_next(GramState &st, const Vector<Token> &tokens, size_t *first, size_t *last) {
+        while (st.len == 0) {
+            if (st.i >= tokens.size()) {
+                return false;
+            }
+
+            // A run of OTHER tokens right after a non-OTHER token, e.g. 'Hello世界', starts with
+            //  the prefixes of its first window, one position each, so a phrase ending inside
+            //  the window like 'Hello世' still matches. Each prefix is emitted once, shortest
+            //  first, thus the positions keep following the text.
+            bool other = tokens[st.i].get_category() == OTHER;
+            bool in_run = other && st.i > 0 && tokens[st.i - 1].get_category() == OTHER;
+            if (other && !in_run) {
+                st.prefixed_run = st.i > 0;
+            }
+            st.prefixes = other && !in_run && st.prefixed_run;
+
+            // A query ending within the first window of such a run is covered by the prefixes,
+            //  while the document may go on with the run, thus the rest would never match.
+            //  Likewise the first window of a prefix query covers a run shorter than N.
+            st.len = gram_window<N>(tokens, st.i, st.tail_drop ||
+                                                  (st.query && in_run && (st.prefixed_run || st.prefix_query)));
+            if (st.len == 0) {
+                st.i++;
+                continue;
+            }
+            st.u = 0;
+        }
+
+        if (st.prefixes && st.u + 1 < st.len) {
+            *first = st.i;
+            *last = st.i + st.u++;
+            return true;
+        }
+
+        *first = st.i;
+        *last = st.i + st.len - 1;
+
+        st.i++;
+        st.len = 0;
+        return true;
+    }
+
+    /**
+     * Walk the grams of a token vector, each gram is a range of consecutive tokens.
+     *  The iterator holds no text, so it can be stopped and resumed at any gram.
+     *  The gram size is only known at run time here, hot paths call gram_next<N>() directly.
+     */
+    class GramIterator {
+    public:
+        typedef bool (*next_fn_t)(GramState &, const Vector<Token> &, size_t *, size_t *);
+
+        // An iterator without any gram
+        GramIterator();
+
+        GramIterator(const Vector<Token> &, int);
+
+        // @return  false if there is no more gram, otherwise the gram is tokens[*first, *last]
+        bool next(size_t *first, size_t *last);
+
+    private:
+        const Vector<Token> *tokens;
+        next_fn_t next_fn;
+        GramState state;
+    };
+
+    /**
+     * Assemble the bytes of the gram tokens[first, last] into the scratch buffers
+     *
+     * @param ppGram    where to store the gram, points into scratch
+     */
+    void build_gram(
+            const char *pText,
+            const Vector<Token> &tokens,
+            size_t first,
+            size_t last,
+            bool case_sensitive,
+            bool compact_terms,
+            Scratch &scratch,
+            const char **ppGram,
+            int *pnGram);
+}
@@ -0,0 +1,369 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <system_error>
+#include <thread>
+#ifndef SQLITE_CORE
+#include <dlfcn.h>
+#endif
+#ifndef DROMOZOA_NO_GOOGLE_LOGGING
+#include <glog/logging.h>
+#else
+#include "common.hpp"
+#endif
+
+#include "maintain.h"
+#include "tokenizer.h"
+#include "utils.h"
+
+SQLITE_EXTENSION_INIT3
+
+// see:
+//  https://sqlite.org/fts5.html#the_merge_command
+
+/*
+ * Pages merged by one step, a step is one write transaction thus bounds how long other writers wait.
+ *  FTS5 only merges levels holding at least usermerge segments(4 by default), which keeps the
+ *  segment count bounded without rewriting the whole index as optimize does.
+ */
+#define MERGE_PAGES_PER_STEP    16
+
+// Longest wait after failed runs, as a power of two of the interval
+#define MAX_BACKOFF_SHIFT       6
+
+typedef struct {
+    int steps;
+    sqlite3_int64 pages;        /* Changes made by the merges, about the pages written */
+    bool done;                  /* The last merge was a no-op, nothing is left to merge until the next write */
+    bool busy;                  /* Another connection held the write lock for the whole budget */
+    sqlite3_int64 elapsed_ms;
+} maintain_report_t;
+
+/**
+ * Run merge steps on zTable until the budget is spent or nothing is left to merge
+ *  Only what the FTS5 documentation tells of a merge is used, the structure of the index is not read.
+ */
+static int maintain_run(sqlite3 *db, const char *zTable, int budget_ms, maintain_report_t *report) {
+    auto start = std::chrono::steady_clock::now();
+    *report = maintain_report_t();
+
+    char *zSql = sqlite3_mprintf("INSERT INTO main.\"%w\"(\"%w\", rank) VALUES('merge', %d)",
+                                 zTable, zTable, MERGE_PAGES_PER_STEP);
+    if (zSql == nullptr) {
+        return SQLITE_NOMEM;
+    }
+    sqlite3_stmt *pStmt = nullptr;
+    int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, nullptr);
+    sqlite3_free(zSql);
+
+    auto budget = std::chrono::milliseconds(budget_ms);
+    while (rc == SQLITE_OK && std::chrono::steady_clock::now() - start < budget) {
+        // [qt.] If the difference is less than 2, then the 'merge' command was a no-op
+        int before = sqlite3_total_changes(db);
+        rc = sqlite3_step(pStmt);
+        rc = rc == SQLITE_DONE ? sqlite3_reset(pStmt) : (sqlite3_reset(pStmt), rc);
+        if (rc == SQLITE_BUSY) {
+            report->busy = true;
+            rc = SQLITE_OK;
+            break;
+        }
+        int changes = sqlite3_total_changes(db) - before;
+        if (rc != SQLITE_OK || changes < 2) {
+            report->done = rc == SQLITE_OK;
+            break;
+        }
+        report->steps++;
+        report->pages += changes;
+    }
+    sqlite3_finalize(pStmt);
+
+    report->elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    return rc;
+}
+
+static char *report_json(const maintain_report_t *report) {
+    return sqlite3_mprintf(
+            "{\"steps\":%d,\"pages\":%lld,\"done\":%s,\"busy\":%s,\"elapsed_ms\":%lld}",
+            report->steps, report->pages, report->done ? "true" : "false", report->busy ? "true" : "false",
+            report->elapsed_ms);
+}
+
+/*
+ * Background maintenance of one table, on a connection of its own so that every merge step
+ *  commits by itself and waits for the write lock like any other writer.
+ */
+typedef struct maintain_worker {
+    std::string filename;
+    std::string table;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    int budget_ms;
+    int interval_ms;
+    bool stop;
+    bool has_report;
+    int failures;               /* Runs failed in a row, each one doubles the wait up to MAX_BACKOFF_SHIFT */
+    std::string error;          /* Why the worker gave up, empty while it runs */
+    maintain_report_t report;   /* Of the last successful run */
+} maintain_worker_t;
+
+static void worker_main(maintain_worker_t *worker) {
+    sqlite3 *db = nullptr;
+    int rc = ngram_open_worker(worker->filename.c_str(), SQLITE_OPEN_READWRITE, &db);
+
+    std::unique_lock<std::mutex> lock(worker->mutex);
+    if (rc != SQLITE_OK) {
+        // Retrying would not make the file readable, the next call reports it and starts over
+        worker->error = db != nullptr ? sqlite3_errmsg(db) : sqlite3_errstr(rc);
+        LOG(ERROR) << "Cannot open " << worker->filename << ": " << worker->error;
+        lock.unlock();
+        sqlite3_close(db);
+        return;
+    }
+    while (!worker->stop) {
+        int budget_ms = worker->budget_ms;
+        lock.unlock();
+
+        // A step waits for other writers at most for the budget
+        maintain_report_t report;
+        sqlite3_busy_timeout(db, budget_ms);
+        int run_rc = maintain_run(db, worker->table.c_str(), budget_ms, &report);
+
+        lock.lock();
+        if (run_rc == SQLITE_OK) {
+            worker->report = report;
+            worker->has_report = true;
+            worker->failures = 0;
+        } else if (worker->failures++ == 0) {
+            // Errors of a run such as a locked schema are retried later, logged once until a run succeeds
+            LOG(ERROR) << "Cannot maintain " << worker->table << ": " << sqlite3_errmsg(db);
+        }
+        auto wait = std::chrono::milliseconds(
+                (int64_t) worker->interval_ms << std::min(worker->failures, MAX_BACKOFF_SHIFT));
+        worker->cond.wait_for(lock, wait, [worker]() {
+            return worker->stop;
+        });
+    }
+    lock.unlock();
+    sqlite3_close(db);
+}
+
+/*
+ * Workers by database file and table
+ *  Stopped at exit, as the threads must not outlive the process-wide state they use.
+ */
+class maintain_workers {
+public:
+    std::mutex mutex;
+    std::map<std::string, maintain_worker_t *> workers;
+
+    ~maintain_workers() {
+        for (auto &e: workers) {
+            stop(e.second);
+        }
+    }
+
+    static void stop(maintain_worker_t *worker) {
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->stop = true;
+        }
+        worker->cond.notify_all();
+        worker->thread.join();
+        delete worker;
+    }
+};
+
+static maintain_workers workers;
+
+#ifndef SQLITE_CORE
+
+/**
+ * Keep the shared library mapped for the rest of the process
+ *  SQLite unloads an extension when the connection that loaded it is closed, under a running worker.
+ */
+static bool pin_library() {
+    static std::once_flag pin_once;
+    static bool pinned = false;
+    std::call_once(pin_once, []() {
+        Dl_info info;
+        if (dladdr((void *) pin_library, &info) != 0 && info.dli_fname != nullptr) {
+            pinned = dlopen(info.dli_fname, RTLD_NOW | RTLD_NODELETE) != nullptr;
+        }
+    });
+    return pinned;
+}
+
+#endif
+
+static void result_report(sqlite3_context *pCtx, const maintain_report_t *report) {
+    char *zJson = report_json(report);
+    if (zJson == nullptr) {
+        sqlite3_result_error_nomem(pCtx);
+        return;
+    }
+    sqlite3_result_text(pCtx, zJson, -1, sqlite3_free);
+}
+
+/**
+ * Start, update or stop(interval_ms = 0) the worker of zTable
+ *
+ * @return  the report of the last run of the worker, NULL before its first run
+ */
+static void maintain_background(sqlite3_context *pCtx, const char *zTable, int budget_ms, int interval_ms) {
+    sqlite3 *db = sqlite3_context_db_handle(pCtx);
+    const char *zFilename = sqlite3_db_filename(db, "main");
+    if (zFilename == nullptr || zFilename[0] == '\0') {
+        sqlite3_result_error(pCtx, LIBNAME "_maintain(): a background worker needs a database file", -1);
+        return;
+    }
+    if (!sqlite3_threadsafe()) {
+        sqlite3_result_error(pCtx, LIBNAME "_maintain(): SQLite is built without threads", -1);
+        return;
+    }
+    std::string key = std::string(zFilename) + '\0' + zTable;
+
+    // Joined once the registry is unlocked, a run may take the whole budget to end
+    maintain_worker_t *stopped = nullptr;
+    std::unique_lock<std::mutex> lock(workers.mutex);
+    auto it = workers.workers.find(key);
+    maintain_worker_t *worker = it != workers.workers.end() ? it->second : nullptr;
+    maintain_report_t report;
+    bool has_report = false;
+    std::string error;
+    if (worker != nullptr) {
+        std::lock_guard<std::mutex> worker_lock(worker->mutex);
+        report = worker->report;
+        has_report = worker->has_report;
+        error = worker->error;
+    }
+
+    if (!error.empty()) {
+        workers.workers.erase(it);
+        lock.unlock();
+        maintain_workers::stop(worker);
+        char *zErr = sqlite3_mprintf(LIBNAME "_maintain(): the worker has stopped: %s", error.c_str());
+        sqlite3_result_error(pCtx, zErr != nullptr ? zErr : "out of memory", -1);
+        sqlite3_free(zErr);
+        return;
+    } else if (interval_ms <= 0) {
+        if (worker != nullptr) {
+            workers.workers.erase(it);
+            stopped = worker;
+        }
+    } else if (worker != nullptr) {
+        {
+            std::lock_guard<std::mutex> worker_lock(worker->mutex);
+            worker->budget_ms = budget_ms;
+            worker->interval_ms = interval_ms;
+        }
+        worker->cond.notify_all();
+    } else {
+#ifndef SQLITE_CORE
+        if (!pin_library()) {
+            sqlite3_result_error(pCtx, LIBNAME "_maintain(): cannot keep the extension loaded", -1);
+            return;
+        }
+#endif
+        try {
+            worker = new maintain_worker_t();
+            worker->filename = zFilename;
+            worker->table = zTable;
+            worker->budget_ms = budget_ms;
+            worker->interval_ms = interval_ms;
+            worker->stop = false;
+            worker->has_report = false;
+            worker->failures = 0;
+            worker->thread = std::thread(worker_main, worker);
+            workers.workers[key] = worker;
+        } catch (const std::bad_alloc &) {
+            delete worker;
+            sqlite3_result_error_nomem(pCtx);
+            return;
+        } catch (const std::system_error &e) {
+            delete worker;
+            LOG(ERROR) << "Cannot start a maintain worker: " << e.what();
+            sqlite3_result_error(pCtx, LIBNAME "_maintain(): cannot start a thread", -1);
+            return;
+        }
+    }
+    lock.unlock();
+    if (stopped != nullptr) {
+        maintain_workers::stop(stopped);
+    }
+
+    if (has_report) {
+        result_report(pCtx, &report);
+    } else {
+        sqlite3_result_null(pCtx);
+    }
+}
+
+static void ngram_maintain_func(sqlite3_context *pCtx, int nVal, sqlite3_value **apVal) {
+    CHECK(nVal == 2 || nVal == 3);
+
+    auto zTable = (const char *) sqlite3_value_text(apVal[0]);
+    if (zTable == nullptr) {
+        sqlite3_result_null(pCtx);
+        return;
+    }
+    int budget_ms = std::max(sqlite3_value_int(apVal[1]), 0);
+
+    // The worker connection needs the tokenizer to open the table, thus only ngram tables
+    sqlite3 *db = sqlite3_context_db_handle(pCtx);
+    sqlite3_stmt *pStmt = nullptr;
+    int rc = sqlite3_prepare_v2(db, "SELECT sql FROM main.sqlite_master WHERE type = 'table' AND name = ?",
+                                -1, &pStmt, nullptr);
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error_code(pCtx, rc);
+        return;
+    }
+    sqlite3_bind_text(pStmt, 1, zTable, -1, SQLITE_STATIC);
+    bool found = false;
+    try {
+        ngram_tokenizer::String options;
+        if (sqlite3_step(pStmt) == SQLITE_ROW) {
+            auto zSql = (const char *) sqlite3_column_text(pStmt, 0);
+            found = zSql != nullptr && ngram_parse_tokenize_option(zSql, options);
+        }
+    } catch (const std::bad_alloc &) {
+        sqlite3_finalize(pStmt);
+        sqlite3_result_error_nomem(pCtx);
+        return;
+    }
+    sqlite3_finalize(pStmt);
+    if (!found) {
+        char *zErr = sqlite3_mprintf("%s is not an FTS5 table using the " LIBNAME " tokenizer", zTable);
+        sqlite3_result_error(pCtx, zErr != nullptr ? zErr : "out of memory", -1);
+        sqlite3_free(zErr);
+        return;
+    }
+
+    if (nVal == 3) {
+        maintain_background(pCtx, zTable, budget_ms, sqlite3_value_int(apVal[2]));
+        return;
+    }
+
+    maintain_report_t report;
+    rc = maintain_run(db, zTable, budget_ms, &report);
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error(pCtx, sqlite3_errmsg(db), -1);
+        return;
+    }
+    result_report(pCtx, &report);
+}
+
+int ngram_maintain_register(sqlite3 *db) {
+    int rc = sqlite3_create_function(db, LIBNAME "_maintain", 2, SQLITE_UTF8 | SQLITE_DIRECTONLY,
+                                     nullptr, ngram_maintain_func, nullptr, nullptr);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_create_function(db, LIBNAME "_maintain", 3, SQLITE_UTF8 | SQLITE_DIRECTONLY,
+                                     nullptr, ngram_maintain_func, nullptr, nullptr);
+    }
+    return rc;
+}
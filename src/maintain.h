@@ -0,0 +1,11 @@
+#pragma once
+
+#include "sqlite3ext.h"
+
+/*
+ * ngram_maintain(fts_table, budget_ms[, interval_ms])
+ *  Incremental merges of the FTS5 segments until the time budget is spent, reported as JSON.
+ *  With interval_ms, a background thread on its own connection does the same every interval_ms,
+ *  zero stops it.
+ */
+int ngram_maintain_register(sqlite3 *db);
@@ -6,21 +6,41 @@
  */
 
 #include <cstring>
+#include <cctype>
+#include <strings.h>
 #ifndef DROMOZOA_NO_GOOGLE_LOGGING
 #include <glog/logging.h>
 #else
 #include "common.hpp"
 #endif
 #include <iostream>
-#include <sstream>
 #include <algorithm>
+#include <mutex>
+#include <new>
 
 #include "sqlite3ext.h"      /* Do not use <sqlite3.h>! */
 
 SQLITE_EXTENSION_INIT1
 
+#include "ngram.h"
+
 #include "utils.h"
 #include "token_vector.h"
+#include "compact_term.h"
+#include "scratch.h"
+#include "stats.h"
+#include "allocator.h"
+#include "tokenizer.h"
+#include "gram_iterator.h"
+#include "tokens_vtab.h"
+#include "advise_vtab.h"
+#include "phrase_lookup.h"
+#include "similar_vtab.h"
+#include "rank.h"
+#include "offsets.h"
+#include "maintain.h"
+#include "query_rewrite.h"
+#include "shards_vtab.h"
 #ifndef DROMOZOA_NO_HIGHRIGHT
 #include "highlight.h"
 #endif
@@ -59,19 +79,6 @@ static inline fts5_api *fts5_api_from_db(sqlite3 *db) {
     return pFts5Api;
 }
 
-// see:
-//  7.1. Custom Tokenizers
-//  https://sqlite.org/fts5.html#custom_tokenizers
-
-#define MIN_GRAM        1   /* Essentially strstr(3) */
-#define MAX_GRAM        4
-#define DEFAULT_GRAM    2
-
-typedef struct {
-    int ngram;
-    bool case_sensitive;
-} ngram_context_t;
-
 /**
  * [qt.]
  *  The final argument is an output variable.
@@ -79,7 +86,7 @@ typedef struct {
  *  If an error occurs, some value other than SQLITE_OK should be returned.
  *  In this case, fts5 assumes that the final value of *ppOut is undefined.
  */
-static int ngram_cb_create(void *pCtx, const char **azArg, int nArg, Fts5Tokenizer **ppOut) {
+int ngram_cb_create(void *pCtx, const char **azArg, int nArg, Fts5Tokenizer **ppOut) {
     DLOG(INFO) << "Creating FTS5 ngram tokenizer ...";
     DLOG(INFO) << "pCtx: " << pCtx << " azArg: " << azArg << " nArg: " << nArg << " ppOut: " << ppOut;
 
@@ -89,16 +96,17 @@ static int ngram_cb_create(void *pCtx, const char **azArg, int nArg, Fts5Tokeniz
     CHECK_NOTNULL(ppOut);
 
     auto *pFts5Api = (fts5_api *) pCtx;
-    UNUSED(pFts5Api);
 
-    auto *ctx = (ngram_context_t *) sqlite3_malloc(sizeof(ngram_context_t));
-    if (ctx == nullptr) {
-        LOG(ERROR) << "sqlite3_malloc() fail, size: " << sizeof(*ctx);
+    void *mem = sqlite3_malloc(sizeof(ngram_context_t));
+    if (mem == nullptr) {
+        LOG(ERROR) << "sqlite3_malloc() fail, size: " << sizeof(ngram_context_t);
         return SQLITE_NOMEM;
     }
-    (void) memset(ctx, 0, sizeof(*ctx));
+    // Value-initialization zeroes the plain members
+    auto *ctx = new(mem) ngram_context_t();
 
-    ctx->ngram = DEFAULT_GRAM;
+    ctx->options.ngram = DEFAULT_GRAM;
+    ctx->query_cache.set_capacity(DEFAULT_QUERY_CACHE);
     for (int i = 0; i < nArg; i++) {
         if (!strcmp(azArg[i], "gram")) {
             if (++i >= nArg) {
@@ -115,21 +123,63 @@ static int ngram_cb_create(void *pCtx, const char **azArg, int nArg, Fts5Tokeniz
                 LOG(ERROR) << gram << "-gram is out of range, should in range [" << MIN_GRAM << ", " << MAX_GRAM << "]";
                 goto out_fail;
             }
-            ctx->ngram = gram;
+            ctx->options.ngram = gram;
         } else if (!strcmp(azArg[i], "case_sensitive")) {
-            ctx->case_sensitive = true;
+            ctx->options.case_sensitive = true;
+        } else if (!strcmp(azArg[i], "compact_terms")) {
+            ctx->options.compact_terms = true;
+        } else if (!strcmp(azArg[i], "query_cache")) {
+            if (++i >= nArg) {
+                LOG(ERROR) << "query_cache expected one argument, got nothing.";
+                goto out_fail;
+            }
+
+            int entries;
+            if (!ngram_tokenizer::parse_int(azArg[i], '\0', 10, &entries)) {
+                LOG(ERROR) << "parse_int() fail, str: " << azArg[i];
+                goto out_fail;
+            }
+            if (entries < 0 || entries > MAX_QUERY_CACHE) {
+                LOG(ERROR) << "query_cache " << entries << " is out of range, should in range [0, " << MAX_QUERY_CACHE << "]";
+                goto out_fail;
+            }
+            ctx->query_cache.set_capacity(entries);
+        } else if (!strcmp(azArg[i], "delegate")) {
+            // All the rest arguments make up the downstream tokenizer, e.g. "delegate porter unicode61"
+            if (++i >= nArg) {
+                LOG(ERROR) << "delegate expected a tokenizer name, got nothing.";
+                goto out_fail;
+            }
+
+            void *pUserData = nullptr;
+            int rc = pFts5Api->xFindTokenizer(pFts5Api, azArg[i], &pUserData, &ctx->delegate);
+            if (rc != SQLITE_OK) {
+                LOG(ERROR) << "xFindTokenizer() fail, name: " << azArg[i] << " rc: " << rc;
+                goto out_fail;
+            }
+            rc = ctx->delegate.xCreate(pUserData, azArg + i + 1, nArg - i - 1, &ctx->pDelegate);
+            if (rc != SQLITE_OK) {
+                LOG(ERROR) << "Cannot create delegate tokenizer " << azArg[i] << ", rc: " << rc;
+                goto out_fail;
+            }
+            break;
         } else {
             LOG(ERROR) << "unrecognizable option at index " << i << ": " << azArg[i];
             goto out_fail;
         }
     }
 
-    DLOG(INFO) << "ngram = " << ctx->ngram;
-    DLOG(INFO) << "case_sensitive = " << ctx->case_sensitive;
+    // The gram size is fixed from now on, pick its instantiation once
+    ctx->engine = ngram_tokenizer::gram_engine(ctx->options.ngram);
+
+    DLOG(INFO) << "ngram = " << ctx->options.ngram;
+    DLOG(INFO) << "case_sensitive = " << ctx->options.case_sensitive;
+    DLOG(INFO) << "compact_terms = " << ctx->options.compact_terms;
     *ppOut = (Fts5Tokenizer *) ctx;
     return SQLITE_OK;
 
     out_fail:
+    ctx->~ngram_context_t();
     sqlite3_free(ctx);
     return SQLITE_ERROR;
 }
@@ -139,56 +189,149 @@ static int ngram_cb_create(void *pCtx, const char **azArg, int nArg, Fts5Tokeniz
  * This function is invoked to delete a tokenizer handle previously allocated using xCreate().
  * Fts5 guarantees that this function will be invoked exactly once for each successful call to xCreate().
  */
-static void ngram_cb_delete(Fts5Tokenizer *pTok) {
+void ngram_cb_delete(Fts5Tokenizer *pTok) {
     DLOG(INFO) << "Freeing FTS5 " LIBNAME " tokenizer...";
 
     CHECK_NOTNULL(pTok);
     auto *ctx = (ngram_context_t *) pTok;
-    DLOG(INFO) << "pTok: " << ctx << " ngram: " << ctx->ngram;
+    DLOG(INFO) << "pTok: " << ctx << " ngram: " << ctx->options.ngram;
 
+    if (ctx->pDelegate != nullptr) {
+        ctx->delegate.xDelete(ctx->pDelegate);
+    }
+    ctx->~ngram_context_t();
     sqlite3_free(ctx);
-
-#ifndef DEBUG
-    google::ShutdownGoogleLogging();
-#endif
 }
 
-typedef int (*xTokenCallback)(
-        void *pCtx,         /* Copy of 2nd argument to xTokenize() */
-        int tflags,         /* Mask of FTS5_TOKEN_* flags */
-        const char *pToken, /* Pointer to buffer containing token */
-        int nToken,         /* Size of token in bytes */
-        int iStart,         /* Byte offset of token within input text */
-        int iEnd            /* Byte offset of end of token within input text */
-);
-
-static inline void do_tokenize(
-        const std::vector<ngram_tokenizer::Token> &arr,
-        size_t last_index,
-        xTokenCallback xToken,
-        ngram_context_t *ctx,
-        void *pCtx) {
-    static size_t first_index = 0;
+/**
+ * Create a tokenizer from an options string as written after the tokenizer name in tokenize = '...',
+ *  used by the table-valued functions which take the options as a single SQL argument.
+ */
+int ngram_cb_create_options(fts5_api *pFts5Api, const char *zOptions, Fts5Tokenizer **ppOut) {
+    ngram_tokenizer::Vector<ngram_tokenizer::String> args;
+    const char *p = zOptions;
+    while (*p) {
+        while (*p && isspace((unsigned char) *p)) p++;
+        const char *q = p;
+        while (*q && !isspace((unsigned char) *q)) q++;
+        if (q != p) {
+            args.emplace_back(p, q - p);
+        }
+        p = q;
+    }
+    ngram_tokenizer::Vector<const char *> azArg;
+    for (const auto &arg: args) {
+        azArg.emplace_back(arg.c_str());
+    }
+    // Terminated like argv, so the array is never null even without options
+    azArg.emplace_back(nullptr);
 
-    int iStart = arr[first_index].get_iStart();
-    int iEnd = arr[last_index].get_iEnd();
-    CHECK_LT(iStart, iEnd);
+    return ngram_cb_create(pFts5Api, azArg.data(), (int) azArg.size() - 1, ppOut);
+}
 
-    std::stringstream ss;
-    for (size_t i = first_index; i <= last_index; i++) {
-        ss << arr[i].get_str();
+/**
+ * Take one FTS5 string off the front of p, either a bareword or a quoted string with doubled quotes
+ *
+ * see: https://sqlite.org/fts5.html#fts5_strings
+ */
+static const char *dequote_word(const char *p, const char *end, ngram_tokenizer::String &out) {
+    out.clear();
+    char quote = *p;
+    if (quote == '\'' || quote == '"' || quote == '`' || quote == '[') {
+        if (quote == '[') quote = ']';
+        for (p++; p < end; p++) {
+            if (*p == quote) {
+                if (p + 1 < end && p[1] == quote && quote != ']') {
+                    out += *p++;
+                    continue;
+                }
+                return p + 1;
+            }
+            out += *p;
+        }
+        return p;
+    }
+    while (p < end && !isspace((unsigned char) *p) && *p != ',' && *p != ')' && *p != '=') {
+        out += *p++;
     }
-    std::string s = ss.str();
+    return p;
+}
 
-    if (!ctx->case_sensitive) {
-        // https://stackoverflow.com/questions/313970/how-to-convert-an-instance-of-stdstring-to-lower-case/313990#313990
-        std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+/**
+ * Find the name = value option in the CREATE VIRTUAL TABLE statement of an FTS5 table
+ *  The value is stored dequoted.
+ *
+ * @return  false if the statement has no such option
+ */
+bool ngram_parse_fts5_option(const char *zSql, const char *zName, ngram_tokenizer::String &value) {
+    const char *p = strchr(zSql, '(');
+    if (p == nullptr) {
+        return false;
+    }
+    const char *end = zSql + strlen(zSql);
+    ngram_tokenizer::String word;
+    for (p++; p < end;) {
+        while (p < end && (isspace((unsigned char) *p) || *p == ',')) p++;
+        if (p >= end || *p == ')') {
+            break;
+        }
+        p = dequote_word(p, end, word);
+        bool is_name = !strcasecmp(word.c_str(), zName);
+        while (p < end && isspace((unsigned char) *p)) p++;
+        if (p < end && *p == '=') {
+            for (p++; p < end && isspace((unsigned char) *p); p++);
+            p = dequote_word(p, end, word);
+            if (is_name) {
+                value = word;
+                return true;
+            }
+        }
+        // Skip the rest of the argument, e.g. a column type
+        while (p < end && *p != ',' && *p != ')') {
+            if (*p == '\'' || *p == '"' || *p == '`' || *p == '[') {
+                p = dequote_word(p, end, word);
+            } else {
+                p++;
+            }
+        }
     }
+    return false;
+}
 
-    DLOG(INFO) << "> result token = '" << s << "'"
-               << " iStart = " << iStart
-               << " iEnd = " << iEnd;
-    xToken(pCtx, 0, s.c_str(), (int) s.length(), iStart, iEnd);
+/**
+ * Find the tokenize = '...' option in the CREATE VIRTUAL TABLE statement of an FTS5 table
+ *  The options of the tokenizer are stored into options, without the tokenizer name.
+ *
+ * @return  false if the table does not use this tokenizer
+ */
+bool ngram_parse_tokenize_option(const char *zSql, ngram_tokenizer::String &options) {
+    ngram_tokenizer::String value;
+    if (!ngram_parse_fts5_option(zSql, "tokenize", value)) {
+        return false;
+    }
+    // The value is again a list of strings, e.g. 'ngram gram 3' or "'ngram' 'gram' '3'"
+    const char *q = value.c_str();
+    const char *qend = q + value.size();
+    ngram_tokenizer::String arg;
+    bool first = true;
+    options.clear();
+    while (q < qend) {
+        while (q < qend && isspace((unsigned char) *q)) q++;
+        if (q >= qend) {
+            break;
+        }
+        q = dequote_word(q, qend, arg);
+        if (first) {
+            if (arg != LIBNAME) {
+                return false;
+            }
+            first = false;
+        } else {
+            options += ' ';
+            options += arg;
+        }
+    }
+    return !first;
 }
 
 /**
@@ -199,7 +342,7 @@ static inline void do_tokenize(
  *  if an error occurs with the xTokenize() implementation itself,
  *  it may abandon the tokenization and return any error code other than SQLITE_OK or SQLITE_DONE.
  */
-static int ngram_cb_tokenize(
+static int tokenize_ngram(
         Fts5Tokenizer *pTok,
         void *pCtx,
         int flags,          /* Mask of FTS5_TOKENIZE_* flags */
@@ -212,110 +355,405 @@ static int ngram_cb_tokenize(
     CHECK_GE(nText, 0);
     CHECK_NOTNULL(xToken);
 
-    auto *pFts5Api = (fts5_api *) pCtx;
-    UNUSED(pFts5Api);
-
     auto *ctx = (ngram_context_t *) pTok;
-    DLOG(INFO) << ctx->ngram << "-gram tokenizing ...";
     DLOG(INFO) << "pTok: " << pTok << " pCtx: " << pCtx << " flags: " << flags;
-    // [quote] ... pText may or may not be nul-terminated.
-    DLOG(INFO) << "nText: " << nText << " pText: " << std::string(pText, 0, nText);
     DLOG(INFO) << "xToken: " << xToken;
 
-    if (ngram_tokenizer::utf8_validatestr(reinterpret_cast<const u_int8_t *>(pText), nText) != 0) {
+    int rc = ngram_tokenizer::tokenize_text(ctx->options, ctx->engine, ctx->scratch, pCtx,
+                                            (flags & FTS5_TOKENIZE_QUERY ? GRAM_QUERY : 0) |
+                                            (flags & FTS5_TOKENIZE_PREFIX ? GRAM_PREFIX : 0),
+                                            pText, nText, xToken);
+    if (rc == GRAM_INVALID_TEXT) {
         LOG(ERROR) << "Met invalid UTF-8 character(s) in the input text, please check the text or issue a bug report";
         return SQLITE_ERROR;
     }
+    return rc;
+}
+
+typedef struct {
+    void *pCtx;
+    xTokenCallback xToken;
+    int base;           /* Byte offset of the run within the whole input text */
+} rebase_context_t;
+
+static int rebase_cb(void *pCtx, int tflags, const char *pToken, int nToken, int iStart, int iEnd) {
+    auto *rebase = (rebase_context_t *) pCtx;
+    return rebase->xToken(rebase->pCtx, tflags, pToken, nToken, rebase->base + iStart, rebase->base + iEnd);
+}
+
+/**
+ * Split the input text into CJK and non-CJK runs,
+ *  the former are n-grammed as usual while the latter are handed to the delegate tokenizer.
+ */
+static int tokenize_delegating(
+        Fts5Tokenizer *pTok,
+        void *pCtx,
+        int flags,
+        const char *pText,
+        int nText,
+        xTokenCallback xToken) {
+    auto *ctx = (ngram_context_t *) pTok;
 
-    auto tv = ngram_tokenizer::TokenVector(pText, nText);
-    if (!tv.tokenize()) {
+    if (ngram_tokenizer::utf8_validatestr(reinterpret_cast<const u_int8_t *>(pText), nText) != 0) {
+        LOG(ERROR) << "Met invalid UTF-8 character(s) in the input text, please check the text or issue a bug report";
         return SQLITE_ERROR;
     }
-    for (const auto &t: tv.get_tokens()) {
-        DLOG(INFO) << "> token = '" << t.get_str()
-                   << "' iStart = " << t.get_iStart()
-                   << " iEnd = " << t.get_iEnd()
-                   << " category = " << t.get_category();
-    }
-
-    const std::vector<ngram_tokenizer::Token> &tokens = tv.get_tokens();
-
-    std::vector<ngram_tokenizer::Token> prevArr;
-    for (size_t i = 0; i < tokens.size(); i++) {
-        std::vector<ngram_tokenizer::Token> arr;
-
-        ngram_tokenizer::token_category_t prev_category;
-        for (int j = 0; j < ctx->ngram; j++) {
-            // Avoid out of array boundary
-            if (i + j >= tokens.size()) {
-                if (tokens.size() >= (size_t) ctx->ngram) {
-                    bool same_category = true;
-
-                    for (int k = 0; k < ctx->ngram; k++) {
-                        ngram_tokenizer::token_category_t category = tokens[tokens.size() - k - 1].get_category();
-                        if (k != 0) {
-                            if (category != prev_category) {
-                                same_category = false;
-                                break;
-                            }
-                        }
-                        prev_category = category;
-                    }
-
-                    // Same category meaning previously last ngram token had been added
-                    // Thus we don't need to cut again(unless they're in different categories)
-                    if (same_category) {
-                        DLOG(INFO)
-                                << "Don't do tokenize for the last N non-complete terms since they're in a same category";
-                        arr.clear();
-                    }
-                }
 
-                break;
-            }
+    rebase_context_t rebase = {pCtx, xToken, 0};
+    int rc = SQLITE_OK;
+    int iStart = 0;
+    while (rc == SQLITE_OK && iStart < nText) {
+        size_t len;
+        bool cjk = ngram_tokenizer::is_cjk(ngram_tokenizer::utf8_decode(pText + iStart, nText - iStart, &len));
+        int iEnd = iStart + (int) len;
+        while (iEnd < nText &&
+               ngram_tokenizer::is_cjk(ngram_tokenizer::utf8_decode(pText + iEnd, nText - iEnd, &len)) == cjk) {
+            iEnd += (int) len;
+        }
 
-            const auto &curr_token = tokens[i + j];
+        DLOG(INFO) << (cjk ? "CJK" : "non-CJK") << " run iStart = " << iStart << " iEnd = " << iEnd;
+        rebase.base = iStart;
+        if (cjk) {
+            rc = tokenize_ngram(pTok, &rebase, flags, pText + iStart, iEnd - iStart, rebase_cb);
+        } else {
+            rc = ctx->delegate.xTokenize(ctx->pDelegate, &rebase, flags, pText + iStart, iEnd - iStart, rebase_cb);
+        }
 
-            if (j != 0) {
-                if (curr_token.get_category() != ngram_tokenizer::OTHER) {
-                    break;
-                }
-                if (curr_token.get_category() != prev_category) {
-                    break;
-                }
+        iStart = iEnd;
+    }
+
+    return rc;
+}
+
+static int tokenize_text(
+        Fts5Tokenizer *pTok,
+        void *pCtx,
+        int flags,
+        const char *pText,
+        int nText,
+        xTokenCallback xToken) {
+    auto *ctx = (ngram_context_t *) pTok;
+    if (ctx->pDelegate != nullptr) {
+        return tokenize_delegating(pTok, pCtx, flags, pText, nText, xToken);
+    }
+    return tokenize_ngram(pTok, pCtx, flags, pText, nText, xToken);
+}
+
+typedef struct {
+    void *pCtx;
+    xTokenCallback xToken;
+    ngram_tokenizer::QueryCache::Entry entry;
+} record_context_t;
+
+static int record_cb(void *pCtx, int tflags, const char *pToken, int nToken, int iStart, int iEnd) {
+    auto *record = (record_context_t *) pCtx;
+    record->entry.add(tflags, pToken, nToken, iStart, iEnd);
+    return record->xToken(record->pCtx, tflags, pToken, nToken, iStart, iEnd);
+}
+
+/**
+ * Replay the tokens of a query seen before, otherwise tokenize it and remember the tokens
+ *  Only a query tokenized to the end is cached, a callback failure leaves a partial entry.
+ */
+static int tokenize_cached(
+        Fts5Tokenizer *pTok,
+        void *pCtx,
+        int flags,
+        const char *pText,
+        int nText,
+        xTokenCallback xToken) {
+    auto *ctx = (ngram_context_t *) pTok;
+
+    auto *entry = ctx->query_cache.find(flags, pText, nText);
+    if (entry != nullptr) {
+        for (const auto &t: entry->tokens) {
+            int rc = xToken(pCtx, t.tflags, entry->terms.data() + t.offset, t.length, t.iStart, t.iEnd);
+            if (rc != SQLITE_OK) {
+                return rc;
             }
+        }
+        return SQLITE_OK;
+    }
 
-            arr.emplace_back(curr_token);
-            prev_category = curr_token.get_category();
+    record_context_t record{pCtx, xToken, {}};
+    int rc = tokenize_text(pTok, &record, flags, pText, nText, record_cb);
+    if (rc == SQLITE_OK) {
+        ctx->query_cache.insert(flags, pText, nText, std::move(record.entry));
+    }
+    return rc;
+}
+
+int ngram_cb_tokenize(
+        Fts5Tokenizer *pTok,
+        void *pCtx,
+        int flags,          /* Mask of FTS5_TOKENIZE_* flags */
+        const char *pText,
+        int nText,
+        xTokenCallback xToken) {
+    auto *ctx = (ngram_context_t *) pTok;
+    CHECK_NOTNULL(ctx);
+
+    int rc;
+    ctx->scratch.begin();
+    try {
+        if ((flags & FTS5_TOKENIZE_QUERY) && ctx->query_cache.accepts(nText)) {
+            rc = tokenize_cached(pTok, pCtx, flags, pText, nText, xToken);
+        } else {
+            rc = tokenize_text(pTok, pCtx, flags, pText, nText, xToken);
         }
+    } catch (const std::bad_alloc &) {
+        // Never let exceptions unwind through the C frames of FTS5
+        LOG(ERROR) << "Out of memory while tokenizing, nText: " << nText;
+        rc = SQLITE_NOMEM;
+    }
+    ctx->scratch.end();
+    return rc;
+}
 
-        if (!arr.empty()) {
-            // Temporarily solution to the input text case 'Hello世界'
-            if (prevArr.size() == 1 && prevArr[0].get_category() != ngram_tokenizer::OTHER &&
-                arr[0].get_category() == ngram_tokenizer::OTHER) {
-                for (size_t u = 0; u + 1 < arr.size(); u++) {
-                    DLOG(INFO) << "--- " << (u + 1);
-                    for (size_t v = 0; v <= u; v++) {
-                        do_tokenize(arr, v, xToken, ctx, pCtx);
-                    }
-                }
-            }
+/**
+ * ngram_decode(term)
+ *  Convert a term produced by the compact_terms option back to UTF-8 text,
+ *  mostly used to inspect fts5vocab tables. Other terms are returned as is.
+ */
+static void ngram_decode_func(sqlite3_context *pCtx, int nVal, sqlite3_value **apVal) {
+    CHECK_EQ(nVal, 1);
+
+    auto p = (const char *) sqlite3_value_text(apVal[0]);
+    int n = sqlite3_value_bytes(apVal[0]);
+    if (p == nullptr) {
+        sqlite3_result_null(pCtx);
+        return;
+    }
+
+    if (!ngram_tokenizer::is_compact_term(p, n)) {
+        sqlite3_result_text(pCtx, p, n, SQLITE_TRANSIENT);
+        return;
+    }
+
+    try {
+        ngram_tokenizer::String s;
+        if (!ngram_tokenizer::compact_decode(p, n, s)) {
+            sqlite3_result_error(pCtx, "malformed compact term", -1);
+            return;
+        }
+        sqlite3_result_text(pCtx, s.data(), (int) s.length(), SQLITE_TRANSIENT);
+    } catch (const std::bad_alloc &) {
+        sqlite3_result_error_nomem(pCtx);
+    }
+}
+
+/**
+ * ngram_stat(name)
+ *  Return a process-wide counter of the extension, e.g. 'scratch_bytes'.
+ */
+static void ngram_stat_func(sqlite3_context *pCtx, int nVal, sqlite3_value **apVal) {
+    CHECK_EQ(nVal, 1);
+
+    auto name = (const char *) sqlite3_value_text(apVal[0]);
+    ngram_tokenizer::stat_t stat;
+    if (name == nullptr || !ngram_tokenizer::stat_lookup(name, &stat)) {
+        sqlite3_result_error(pCtx, "unknown " LIBNAME "_stat() name", -1);
+        return;
+    }
+    sqlite3_result_int64(pCtx, ngram_tokenizer::stat_get(stat));
+}
+
+#if SQLITE_VERSION_NUMBER >= 3047000
+typedef enum {
+    WORD_SEPARATOR,
+    WORD_DIGIT,
+    WORD_LETTER,
+    WORD_PUNCTUATION,
+} word_class_t;
+
+static inline word_class_t word_class(unsigned char c) {
+    // Non-ASCII bytes count as letters
+    if (c >= 0x80 || isalpha(c)) {
+        return WORD_LETTER;
+    }
+    if (isdigit(c)) {
+        return WORD_DIGIT;
+    }
+    if (ispunct(c)) {
+        return WORD_PUNCTUATION;
+    }
+    return WORD_SEPARATOR;
+}
+
+/**
+ * Word tokenization for scripts separated by white spaces
+ *  ASCII text is cut exactly like the ngram path does(runs of digits, letters and punctuations),
+ *  while non-ASCII characters are glued into the surrounding word instead of being n-grammed.
+ */
+static int tokenize_words(
+        ngram_context_t *ctx,
+        void *pCtx,
+        const char *pText,
+        int nText,
+        xTokenCallback xToken) {
+    if (ngram_tokenizer::utf8_validatestr(reinterpret_cast<const u_int8_t *>(pText), nText) != 0) {
+        LOG(ERROR) << "Met invalid UTF-8 character(s) in the input text, please check the text or issue a bug report";
+        return SQLITE_ERROR;
+    }
 
-            do_tokenize(arr, arr.size() - 1, xToken, ctx, pCtx);
+    ngram_tokenizer::String &s = ctx->scratch.gram;
+    int iStart = 0;
+    while (iStart < nText) {
+        word_class_t cls = word_class(pText[iStart]);
+        int iEnd = iStart + 1;
+        while (iEnd < nText && word_class(pText[iEnd]) == cls) {
+            iEnd++;
+        }
 
-            prevArr = std::move(arr);
+        if (cls != WORD_SEPARATOR) {
+            s.assign(pText + iStart, iEnd - iStart);
+            if (!ctx->options.case_sensitive) {
+                std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+            }
+            int rc = xToken(pCtx, 0, s.data(), (int) s.length(), iStart, iEnd);
+            if (rc != SQLITE_OK) {
+                return rc;
+            }
         }
+
+        iStart = iEnd;
     }
 
     return SQLITE_OK;
 }
 
+/**
+ * Whether rows in the given locale should be n-grammed
+ *  Only the primary language subtag is looked at, an empty locale means the default(n-gram).
+ *  Languages written without white spaces between words cannot take the word path.
+ */
+static bool locale_wants_ngram(const char *pLocale, int nLocale) {
+    static const char *const NGRAM_LANGUAGES[] = {"ja", "zh", "ko", "th", "lo", "km", "my"};
+
+    if (pLocale == nullptr || nLocale <= 0) {
+        return true;
+    }
+
+    int n = 0;
+    while (n < nLocale && pLocale[n] != '-' && pLocale[n] != '_') {
+        n++;
+    }
+    for (const char *lang: NGRAM_LANGUAGES) {
+        if ((size_t) n == strlen(lang) && !strncasecmp(pLocale, lang, n)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * [qt.]
+ * The second and third arguments are the locale the text is in, as set by fts5_locale().
+ * If no locale was specified, pLocale is NULL and nLocale is 0.
+ */
+static int ngram_cb_tokenize_v2(
+        Fts5Tokenizer *pTok,
+        void *pCtx,
+        int flags,          /* Mask of FTS5_TOKENIZE_* flags */
+        const char *pText,
+        int nText,
+        const char *pLocale,
+        int nLocale,
+        xTokenCallback xToken) {
+    if (locale_wants_ngram(pLocale, nLocale)) {
+        return ngram_cb_tokenize(pTok, pCtx, flags, pText, nText, xToken);
+    }
+
+    CHECK_NOTNULL(pTok);
+    CHECK_NOTNULL(pText);
+    CHECK_GE(nText, 0);
+    CHECK_NOTNULL(xToken);
+
+    auto *ctx = (ngram_context_t *) pTok;
+    DLOG(INFO) << "word tokenizing, locale: " << std::string(pLocale, nLocale);
+    if (ctx->pDelegate != nullptr) {
+        return ctx->delegate.xTokenize(ctx->pDelegate, pCtx, flags, pText, nText, xToken);
+    }
+    int rc;
+    ctx->scratch.begin();
+    try {
+        rc = tokenize_words(ctx, pCtx, pText, nText, xToken);
+    } catch (const std::bad_alloc &) {
+        LOG(ERROR) << "Out of memory while tokenizing, nText: " << nText;
+        rc = SQLITE_NOMEM;
+    }
+    ctx->scratch.end();
+    return rc;
+}
+#endif
+
+/**
+ * Tokenize text in its locale as the v2 tokenizer does, for callers other than FTS5
+ *  A library without locales indexes every value in the default locale, which is then used.
+ */
+int ngram_cb_tokenize_locale(
+        Fts5Tokenizer *pTok,
+        void *pCtx,
+        int flags,
+        const char *pText,
+        int nText,
+        const char *pLocale,
+        int nLocale,
+        xTokenCallback xToken) {
+#if SQLITE_VERSION_NUMBER >= 3047000
+    return ngram_cb_tokenize_v2(pTok, pCtx, flags, pText, nText, pLocale, nLocale, xToken);
+#else
+    UNUSED(pLocale, nLocale);
+    return ngram_cb_tokenize(pTok, pCtx, flags, pText, nText, xToken);
+#endif
+}
+
 static fts5_tokenizer token_handle = {
         .xCreate = ngram_cb_create,
         .xDelete = ngram_cb_delete,
         .xTokenize = ngram_cb_tokenize,
 };
 
+#if SQLITE_VERSION_NUMBER >= 3047000
+static fts5_tokenizer_v2 token_handle_v2 = {
+        .iVersion = 2,
+        .xCreate = ngram_cb_create,
+        .xDelete = ngram_cb_delete,
+        .xTokenize = ngram_cb_tokenize_v2,
+};
+#endif
+
+static void *sqlite_mem_alloc(size_t n) {
+    return sqlite3_malloc64(n);
+}
+
+static void sqlite_mem_free(void *p) {
+    sqlite3_free(p);
+}
+
+/**
+ * One-time initialization of the process, logging is shared by all the connections
+ *  thus it's never shut down.
+ */
+static void init_process() {
+#ifndef SQLITE_CORE
+    // The working memory of the engine is accounted by SQLite from now on.
+    //  Only SQLite calls into the loadable extension, so nothing has been allocated before.
+    ngram_tokenizer::set_mem_hooks(sqlite_mem_alloc, sqlite_mem_free);
+#endif
+
+#ifndef DEBUG
+    google::InitGoogleLogging(LIBNAME);
+#endif
+
+    google::InstallFailureSignalHandler();
+
+    LOG(INFO) << "HEAD commit: " << BUILD_HEAD_COMMIT;
+    LOG(INFO) << "Built by " << BUILD_USER << " at " << BUILD_TIMESTAMP;
+    LOG(INFO) << "SQLite3 compile-time version: " << SQLITE_VERSION;
+    LOG(INFO) << "SQLite3 run-time version: " << sqlite3_libversion();
+}
+
 /**
  * SQLite loadable extension entry point
  * see:
@@ -332,24 +770,19 @@ int sqlite3_ngram_init(
         sqlite3 *db,
         char **pzErrMsg,
         const sqlite3_api_routines *pApi) {
-#ifndef DEBUG
-    google::InitGoogleLogging(LIBNAME);
-#endif
-
-    google::InstallFailureSignalHandler();
-
     CHECK_NOTNULL(db);
     CHECK_NOTNULL(pzErrMsg);
+#ifndef SQLITE_CORE
     CHECK_NOTNULL(pApi);
+#endif
 
     // Initialize the global sqlite3_api variable.
     //  so all sqlite3_*() functions can be used.
     SQLITE_EXTENSION_INIT2(pApi)
 
-    LOG(INFO) << "HEAD commit: " << BUILD_HEAD_COMMIT;
-    LOG(INFO) << "Built by " << BUILD_USER << " at " << BUILD_TIMESTAMP;
-    LOG(INFO) << "SQLite3 compile-time version: " << SQLITE_VERSION;
-    LOG(INFO) << "SQLite3 run-time version: " << sqlite3_libversion();
+    // Connection pools open connections from many threads, the rest is per-connection only
+    static std::once_flag init_once;
+    std::call_once(init_once, init_process);
 
     fts5_api *pFts5Api = fts5_api_from_db(db);
     if (pFts5Api == nullptr) {
@@ -358,9 +791,18 @@ int sqlite3_ngram_init(
         *pzErrMsg = sqlite3_mprintf("%s(): err: %d msg: %s", __func__, err, sqlite3_errstr(err));
         return err;
     }
-    CHECK_EQ(pFts5Api->iVersion, 2);
-
-    int rc = pFts5Api->xCreateTokenizer(pFts5Api, LIBNAME, (void *) pFts5Api, &token_handle, nullptr);
+    CHECK_GE(pFts5Api->iVersion, 2);
+
+    int rc;
+#if SQLITE_VERSION_NUMBER >= 3047000
+    // The v2 tokenizer receives the per-value locale, older libraries fall back to v1
+    if (pFts5Api->iVersion >= 3) {
+        rc = pFts5Api->xCreateTokenizer_v2(pFts5Api, LIBNAME, (void *) pFts5Api, &token_handle_v2, nullptr);
+    } else
+#endif
+    {
+        rc = pFts5Api->xCreateTokenizer(pFts5Api, LIBNAME, (void *) pFts5Api, &token_handle, nullptr);
+    }
 #ifndef DROMOZOA_NO_HIGHRIGHT
     if (rc == SQLITE_OK) {
         rc = pFts5Api->xCreateFunction(pFts5Api, LIBNAME "_highlight", pFts5Api, ngram_highlight, nullptr);
@@ -368,3 +810,105 @@ int sqlite3_ngram_init(
 #endif
     return rc;
 }
+
+/**
+ * Entry point of the SQL functions and modules around the tokenizer, registers the tokenizer too
+ *  Kept apart from sqlite3_ngram_init(), so connections of pools and workers only pay for the tokenizer.
+ *
+ *  sqlite> .load libngram.so sqlite3_ngram_tools_init
+ */
+#ifdef _WIN32
+__declspec(dllexport)
+#else
+extern "C"
+#endif
+UNUSED_ATTR
+int sqlite3_ngram_tools_init(
+        sqlite3 *db,
+        char **pzErrMsg,
+        const sqlite3_api_routines *pApi) {
+    int rc = sqlite3_ngram_init(db, pzErrMsg, pApi);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+
+    fts5_api *pFts5Api = fts5_api_from_db(db);
+    CHECK_NOTNULL(pFts5Api);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_create_function(db, LIBNAME "_decode", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                                     nullptr, ngram_decode_func, nullptr, nullptr);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_create_function(db, LIBNAME "_stat", 1, SQLITE_UTF8,
+                                     nullptr, ngram_stat_func, nullptr, nullptr);
+    }
+    if (rc == SQLITE_OK) {
+        rc = ngram_tokens_register(db, pFts5Api);
+    }
+    if (rc == SQLITE_OK) {
+        rc = ngram_advise_register(db, pFts5Api);
+    }
+    if (rc == SQLITE_OK) {
+        rc = ngram_phrase_register(pFts5Api);
+    }
+    if (rc == SQLITE_OK) {
+        rc = ngram_similar_register(db, pFts5Api);
+    }
+    if (rc == SQLITE_OK) {
+        rc = pFts5Api->xCreateFunction(pFts5Api, LIBNAME "_rank", nullptr, ngram_rank, nullptr);
+    }
+    if (rc == SQLITE_OK) {
+        rc = ngram_offsets_register(db, pFts5Api);
+    }
+    if (rc == SQLITE_OK) {
+        rc = ngram_maintain_register(db);
+    }
+    if (rc == SQLITE_OK) {
+        rc = ngram_query_register(db, pFts5Api);
+    }
+    if (rc == SQLITE_OK) {
+        rc = ngram_shards_register(db, pFts5Api);
+    }
+    return rc;
+}
+
+/**
+ * fts5_api of a connection, for the functions a module registers on the connections of its workers
+ */
+fts5_api *ngram_fts5_api(sqlite3 *db) {
+    return fts5_api_from_db(db);
+}
+
+/**
+ * Open a connection for a worker thread, with the extension registered on it
+ *  The caller closes *ppDb even on failure, as with sqlite3_open_v2().
+ */
+int ngram_open_worker(const char *zFilename, int flags, sqlite3 **ppDb) {
+    int rc = sqlite3_open_v2(zFilename, ppDb, flags | SQLITE_OPEN_NOMUTEX, nullptr);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    char *zErr = nullptr;
+#ifdef SQLITE_CORE
+    rc = sqlite3_ngram_init(*ppDb, &zErr, nullptr);
+#else
+    rc = sqlite3_ngram_init(*ppDb, &zErr, sqlite3_api);
+#endif
+    sqlite3_free(zErr);
+    return rc;
+}
+
+#ifdef SQLITE_CORE
+/**
+ * Entry point of the statically linked build(compiled with SQLITE_CORE)
+ *  Register sqlite3_ngram_init() by sqlite3_auto_extension(),
+ *  so every connection opened afterwards has the tokenizer without loading anything.
+ *  The host may call the engine(libngram_core) directly on other threads, thus the memory hooks
+ *  are switched here, at startup before anything is allocated, rather than by the first connection.
+ */
+extern "C"
+int sqlite3_ngram_register(void) {
+    ngram_tokenizer::set_mem_hooks(sqlite_mem_alloc, sqlite_mem_free);
+    return sqlite3_auto_extension((void (*)(void)) sqlite3_ngram_init);
+}
+#endif
@@ -0,0 +1,32 @@
+/**
+ * Public entry points of the ngram extension, for hosts linking it statically
+ *
+ * see: LICENSE.
+ */
+
+#pragma once
+
+#include <sqlite3.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Register the ngram tokenizer on a connection */
+int sqlite3_ngram_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi);
+
+/*
+ * Register the tokenizer and the SQL functions and modules(ngram_tokens, ngram_query, ...) on a connection,
+ *  e.g. by sqlite3_auto_extension((void (*)(void)) sqlite3_ngram_tools_init) for every connection.
+ */
+int sqlite3_ngram_tools_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi);
+
+/*
+ * Only in the static archive(built with SQLITE_CORE):
+ *  call once at startup to register the extension on every connection opened afterwards.
+ */
+int sqlite3_ngram_register(void);
+
+#ifdef __cplusplus
+}
+#endif
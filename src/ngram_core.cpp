@@ -0,0 +1,199 @@
+#include "ngram_core.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <system_error>
+#include <thread>
+
+#include "allocator.h"
+#include "gram_engine.h"
+#include "scratch.h"
+
+// Documents handed to a worker at a time
+#define DOCS_PER_CHUNK      64
+
+namespace {
+    // Grams of a chunk of documents, offsets are relative to the chunk
+    struct Chunk {
+        ngram_tokenizer::Vector<ngram_gram> grams;
+        ngram_tokenizer::Vector<size_t> doc_grams;
+        ngram_tokenizer::Vector<int> doc_status;
+        ngram_tokenizer::String bytes;
+        int rc;
+    };
+
+    int collect_cb(void *pCtx, int tflags, const char *pToken, int nToken, int iStart, int iEnd) {
+        (void) tflags;
+        auto *chunk = (Chunk *) pCtx;
+        chunk->grams.push_back(ngram_gram{chunk->bytes.size(), nToken, iStart, iEnd});
+        chunk->bytes.append(pToken, nToken);
+        return GRAM_OK;
+    }
+
+    void run_chunk(const ngram_tokenizer::GramOptions &options, ngram_tokenizer::gram_engine_t engine,
+                   ngram_tokenizer::Scratch &scratch, const char *const *texts, const size_t *lengths,
+                   size_t first, size_t last, Chunk &chunk) {
+        try {
+            for (size_t i = first; i < last; i++) {
+                chunk.doc_grams.push_back(chunk.grams.size());
+                size_t n_grams = chunk.grams.size();
+                size_t n_bytes = chunk.bytes.size();
+                int rc = GRAM_INVALID_TEXT;
+                if (lengths[i] <= INT_MAX) {
+                    scratch.begin();
+                    rc = ngram_tokenizer::tokenize_text(options, engine, scratch, &chunk, 0,
+                                                        texts[i], (int) lengths[i], collect_cb);
+                    scratch.end();
+                }
+                if (rc != GRAM_OK) {
+                    // Drop whatever the document emitted before the failure
+                    chunk.grams.resize(n_grams);
+                    chunk.bytes.resize(n_bytes);
+                }
+                chunk.doc_status.push_back(rc == GRAM_OK ? NGRAM_OK : NGRAM_INVALID_TEXT);
+            }
+            chunk.rc = NGRAM_OK;
+        } catch (const std::bad_alloc &) {
+            chunk.rc = NGRAM_NOMEM;
+        }
+    }
+
+    size_t align_up(size_t n, size_t alignment) {
+        return (n + alignment - 1) / alignment * alignment;
+    }
+
+    /**
+     * Lay out the chunks in one block, in document order
+     */
+    ngram_batch *assemble(const ngram_tokenizer::Vector<Chunk> &chunks, size_t n_docs) {
+        size_t n_grams = 0;
+        size_t n_bytes = 0;
+        for (const auto &chunk: chunks) {
+            n_grams += chunk.grams.size();
+            n_bytes += chunk.bytes.size();
+        }
+
+        size_t grams_at = align_up(sizeof(ngram_batch), alignof(ngram_gram));
+        size_t doc_grams_at = align_up(grams_at + n_grams * sizeof(ngram_gram), alignof(size_t));
+        size_t doc_status_at = align_up(doc_grams_at + (n_docs + 1) * sizeof(size_t), alignof(int));
+        size_t bytes_at = doc_status_at + n_docs * sizeof(int);
+        auto *base = (char *) std::malloc(bytes_at + n_bytes);
+        if (base == nullptr) {
+            return nullptr;
+        }
+
+        auto *batch = (ngram_batch *) base;
+        auto *grams = (ngram_gram *) (base + grams_at);
+        auto *doc_grams = (size_t *) (base + doc_grams_at);
+        auto *doc_status = (int *) (base + doc_status_at);
+        char *bytes = base + bytes_at;
+
+        size_t gram_base = 0;
+        size_t byte_base = 0;
+        size_t doc = 0;
+        for (const auto &chunk: chunks) {
+            for (size_t i = 0; i < chunk.doc_grams.size(); i++, doc++) {
+                doc_grams[doc] = gram_base + chunk.doc_grams[i];
+                doc_status[doc] = chunk.doc_status[i];
+            }
+            for (const auto &gram: chunk.grams) {
+                grams[gram_base] = gram;
+                grams[gram_base].offset += byte_base;
+                gram_base++;
+            }
+            if (!chunk.bytes.empty()) {
+                memcpy(bytes + byte_base, chunk.bytes.data(), chunk.bytes.size());
+            }
+            byte_base += chunk.bytes.size();
+        }
+        doc_grams[n_docs] = n_grams;
+
+        batch->n_docs = n_docs;
+        batch->n_grams = n_grams;
+        batch->grams = grams;
+        batch->doc_grams = doc_grams;
+        batch->doc_status = doc_status;
+        batch->bytes = bytes;
+        batch->n_bytes = n_bytes;
+        return batch;
+    }
+}
+
+extern "C" void ngram_options_init(ngram_options *options) {
+    options->gram = DEFAULT_GRAM;
+    options->case_sensitive = 0;
+    options->compact_terms = 0;
+}
+
+extern "C" int ngram_tokenize_batch(
+        const ngram_options *options,
+        const char *const *texts,
+        const size_t *lengths,
+        size_t n_docs,
+        int n_threads,
+        ngram_batch **out) {
+    if (options == nullptr || out == nullptr || (n_docs > 0 && (texts == nullptr || lengths == nullptr))) {
+        return NGRAM_MISUSE;
+    }
+    if (options->gram < MIN_GRAM || options->gram > MAX_GRAM) {
+        return NGRAM_MISUSE;
+    }
+    ngram_tokenizer::GramOptions gram_options{options->gram, options->case_sensitive != 0,
+                                              options->compact_terms != 0};
+    ngram_tokenizer::gram_engine_t engine = ngram_tokenizer::gram_engine(gram_options.ngram);
+
+    try {
+        size_t n_chunks = (n_docs + DOCS_PER_CHUNK - 1) / DOCS_PER_CHUNK;
+        ngram_tokenizer::Vector<Chunk> chunks(n_chunks);
+
+        // Each worker keeps its scratch buffers across the chunks it takes
+        std::atomic<size_t> next(0);
+        auto worker = [&]() {
+            ngram_tokenizer::Scratch scratch;
+            size_t i;
+            while ((i = next++) < n_chunks) {
+                size_t first = i * DOCS_PER_CHUNK;
+                run_chunk(gram_options, engine, scratch, texts, lengths,
+                          first, std::min(first + DOCS_PER_CHUNK, n_docs), chunks[i]);
+            }
+        };
+        size_t n_workers = n_threads > 1 ? std::min((size_t) n_threads, n_chunks) : 1;
+        // Reserved up front, a reallocation failing after some threads started would drop joinable threads
+        ngram_tokenizer::Vector<std::thread> threads;
+        threads.reserve(n_workers);
+        for (size_t i = 1; i < n_workers; i++) {
+            try {
+                threads.emplace_back(worker);
+            } catch (const std::system_error &) {
+                // Fewer threads, the calling thread picks up the rest
+                break;
+            }
+        }
+        worker();
+        for (auto &t: threads) {
+            t.join();
+        }
+
+        for (const auto &chunk: chunks) {
+            if (chunk.rc != NGRAM_OK) {
+                return chunk.rc;
+            }
+        }
+        ngram_batch *batch = assemble(chunks, n_docs);
+        if (batch == nullptr) {
+            return NGRAM_NOMEM;
+        }
+        *out = batch;
+        return NGRAM_OK;
+    } catch (const std::bad_alloc &) {
+        return NGRAM_NOMEM;
+    }
+}
+
+extern "C" void ngram_batch_free(ngram_batch *batch) {
+    std::free(batch);
+}
@@ -0,0 +1,68 @@
+/**
+ * Batch tokenization without SQLite, the same grams as the FTS5 tokenizer emits
+ *
+ * see: LICENSE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NGRAM_OK            0
+#define NGRAM_MISUSE        1   /* Invalid options or arguments */
+#define NGRAM_NOMEM         2
+#define NGRAM_INVALID_TEXT  3   /* Per document, the text is not valid UTF-8 */
+
+/* Same meaning as the options of tokenize = 'ngram ...' */
+typedef struct {
+    int gram;
+    int case_sensitive;
+    int compact_terms;
+} ngram_options;
+
+typedef struct {
+    size_t offset;      /* Offset of the gram in ngram_batch.bytes */
+    int length;         /* Size of the gram in bytes */
+    int iStart;         /* Byte offset of the gram within the document */
+    int iEnd;
+} ngram_gram;
+
+/*
+ * Grams of all the documents, allocated as one block
+ *  The grams of document i are grams[doc_grams[i]] up to grams[doc_grams[i + 1]].
+ */
+typedef struct {
+    size_t n_docs;
+    size_t n_grams;
+    const ngram_gram *grams;
+    const size_t *doc_grams;    /* n_docs + 1 entries */
+    const int *doc_status;      /* NGRAM_OK or NGRAM_INVALID_TEXT, a failed document has no gram */
+    const char *bytes;          /* Gram bytes back to back, not NUL-terminated */
+    size_t n_bytes;
+} ngram_batch;
+
+/* Fill in the defaults, 2-gram with ASCII case folding */
+void ngram_options_init(ngram_options *options);
+
+/*
+ * Tokenize n_docs documents, texts[i] of lengths[i] bytes
+ *  The documents are spread over n_threads threads, 0 or 1 runs on the calling thread only.
+ *  On success *out should be released by ngram_batch_free().
+ */
+int ngram_tokenize_batch(
+        const ngram_options *options,
+        const char *const *texts,
+        const size_t *lengths,
+        size_t n_docs,
+        int n_threads,
+        ngram_batch **out);
+
+void ngram_batch_free(ngram_batch *batch);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,789 @@
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <string>
+#ifndef DROMOZOA_NO_GOOGLE_LOGGING
+#include <glog/logging.h>
+#else
+#include "common.hpp"
+#endif
+
+#include "offsets.h"
+#include "phrase_lookup.h"
+#include "stats.h"
+#include "tokenizer.h"
+#include "utils.h"
+
+SQLITE_EXTENSION_INIT3
+
+/*
+ * Layout of an offsets blob, one per column value:
+ *
+ *  varint          byte size of the value, so a blob left over by another value is never used
+ *  varint varint   per position, iStart minus the iStart of the previous position, then iEnd minus iStart
+ *
+ * Varints are little-endian base-128. A colocated token shares the position of the previous one,
+ *  thus takes no entry.
+ */
+
+#define MAX_SNIPPET_TOKENS  64
+
+// Byte range of a token position
+typedef struct {
+    int iStart;
+    int iEnd;
+} range_t;
+
+// Token positions of a phrase instance, both inclusive
+typedef struct {
+    int first;
+    int last;
+} span_t;
+
+static void put_varint(ngram_tokenizer::String &out, uint64_t v) {
+    while (v >= 0x80) {
+        out += (char) (0x80 | (v & 0x7F));
+        v >>= 7;
+    }
+    out += (char) v;
+}
+
+static bool get_varint(const unsigned char **pp, const unsigned char *end, uint64_t *pv) {
+    uint64_t v = 0;
+    for (int shift = 0; *pp < end && shift < 64; shift += 7) {
+        unsigned char c = *(*pp)++;
+        v |= (uint64_t) (c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            *pv = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+typedef struct {
+    ngram_tokenizer::String blob;
+    int prev;           /* iStart of the previous position */
+    bool ordered;       /* No position started before the previous one */
+} encode_context_t;
+
+static int encode_cb(void *pCtx, int tflags, const char *pToken, int nToken, int iStart, int iEnd) {
+    UNUSED(pToken, nToken);
+
+    auto *enc = (encode_context_t *) pCtx;
+    if (tflags & FTS5_TOKEN_COLOCATED) {
+        return SQLITE_OK;
+    }
+    if (iStart < enc->prev || iEnd < iStart) {
+        enc->ordered = false;
+        return SQLITE_DONE;
+    }
+    // Delegate tokenizers call back from C frames, nothing may unwind through them
+    try {
+        put_varint(enc->blob, iStart - enc->prev);
+        put_varint(enc->blob, iEnd - iStart);
+    } catch (const std::bad_alloc &) {
+        return SQLITE_NOMEM;
+    }
+    enc->prev = iStart;
+    return SQLITE_OK;
+}
+
+static void delete_tokenizer(void *p) {
+    ngram_cb_delete((Fts5Tokenizer *) p);
+}
+
+/**
+ * ngram_offsets(text, options[, locale])
+ *  The offsets blob of text under the tokenizer options in the locale, NULL if the text is NULL or
+ *  the positions cannot be delta-encoded. A blob is a value tagged by fts5_locale() whose locale is
+ *  not known here, NULL as well so that the value is tokenized in its locale when it is read.
+ */
+static void ngram_offsets_func(sqlite3_context *pCtx, int nVal, sqlite3_value **apVal) {
+    CHECK_GE(nVal, 2);
+    CHECK_LE(nVal, 3);
+
+    int type = sqlite3_value_type(apVal[0]);
+    if (type == SQLITE_NULL || type == SQLITE_BLOB) {
+        sqlite3_result_null(pCtx);
+        return;
+    }
+
+    // The options are constant in the triggers, thus the tokenizer lives as long as the statement
+    auto *pTok = (Fts5Tokenizer *) sqlite3_get_auxdata(pCtx, 1);
+    bool cached = pTok != nullptr;
+    if (!cached) {
+        auto zOptions = (const char *) sqlite3_value_text(apVal[1]);
+        auto *pFts5Api = (fts5_api *) sqlite3_user_data(pCtx);
+        if (ngram_cb_create_options(pFts5Api, zOptions != nullptr ? zOptions : "", &pTok) != SQLITE_OK) {
+            sqlite3_result_error(pCtx, "invalid " LIBNAME " tokenizer options", -1);
+            return;
+        }
+    }
+
+    auto p = (const char *) sqlite3_value_text(apVal[0]);
+    int n = sqlite3_value_bytes(apVal[0]);
+    auto pLocale = (const char *) (nVal == 3 ? sqlite3_value_text(apVal[2]) : nullptr);
+    int nLocale = pLocale != nullptr ? sqlite3_value_bytes(apVal[2]) : 0;
+    int rc;
+    try {
+        encode_context_t enc;
+        enc.prev = 0;
+        enc.ordered = true;
+        put_varint(enc.blob, (uint64_t) n);
+        rc = ngram_cb_tokenize_locale(pTok, &enc, FTS5_TOKENIZE_DOCUMENT, p, n, pLocale, nLocale, encode_cb);
+        if (rc == SQLITE_OK || rc == SQLITE_DONE) {
+            rc = SQLITE_OK;
+            if (enc.ordered) {
+                sqlite3_result_blob(pCtx, enc.blob.data(), (int) enc.blob.size(), SQLITE_TRANSIENT);
+            } else {
+                sqlite3_result_null(pCtx);
+            }
+        }
+    } catch (const std::bad_alloc &) {
+        rc = SQLITE_NOMEM;
+    }
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error_code(pCtx, rc);
+    }
+
+    if (cached) {
+        return;
+    }
+    sqlite3_set_auxdata(pCtx, 1, pTok, delete_tokenizer);
+}
+
+/**
+ * Run a statement built by sqlite3_mprintf(), which owns zSql
+ */
+static int exec_owned(sqlite3 *db, char *zSql) {
+    if (zSql == nullptr) {
+        return SQLITE_NOMEM;
+    }
+    int rc = sqlite3_exec(db, zSql, nullptr, nullptr, nullptr);
+    sqlite3_free(zSql);
+    return rc;
+}
+
+static void offsets_error(sqlite3_context *pCtx, const char *zFormat, const char *zArg) {
+    char *zErr = sqlite3_mprintf(zFormat, zArg);
+    sqlite3_result_error(pCtx, zErr != nullptr ? zErr : "out of memory", -1);
+    sqlite3_free(zErr);
+}
+
+/**
+ * ngram_offsets_enable(fts_table)
+ *  Create the sidecar table <fts_table>_ngram_offsets and the triggers keeping it in step with the content
+ *  of the FTS5 table, then fill it for the existing rows. An enabled table is filled again from scratch.
+ *
+ *  The triggers are on the table the content is written to: the external content table if there is one,
+ *  otherwise the %_content shadow table, as there can be no trigger on the FTS5 table itself.
+ *  Values of a table with locale=1 are tokenized in the locale of their row.
+ *
+ * @return  the number of rows filled
+ */
+static void ngram_offsets_enable_func(sqlite3_context *pCtx, int nVal, sqlite3_value **apVal) {
+    CHECK_EQ(nVal, 1);
+
+    sqlite3 *db = sqlite3_context_db_handle(pCtx);
+    auto zTable = (const char *) sqlite3_value_text(apVal[0]);
+    if (zTable == nullptr) {
+        sqlite3_result_null(pCtx);
+        return;
+    }
+
+    ngram_fts_table_t table;
+    char *zErr = nullptr;
+    int rc = ngram_fts_table_find(db, zTable, table, &zErr);
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error(pCtx, zErr != nullptr ? zErr : sqlite3_errmsg(db), -1);
+        sqlite3_free(zErr);
+        return;
+    }
+
+    ngram_tokenizer::String content, rowid = "rowid", locale;
+    bool external = ngram_parse_fts5_option(table.sql.c_str(), "content", content);
+    if (external && content.empty()) {
+        offsets_error(pCtx, "%s keeps no content to record the offsets of", zTable);
+        return;
+    }
+    ngram_parse_fts5_option(table.sql.c_str(), "content_rowid", rowid);
+    bool has_locale = !external && ngram_parse_fts5_option(table.sql.c_str(), "locale", locale) && locale == "1";
+    if (!external) {
+        content = table.name + "_content";
+#ifdef SQLITE_DBCONFIG_DEFENSIVE
+        int defensive = 0;
+        sqlite3_db_config(db, SQLITE_DBCONFIG_DEFENSIVE, -1, &defensive);
+        if (defensive) {
+            offsets_error(pCtx, "%s keeps its content in a shadow table, which takes no trigger in defensive mode",
+                          zTable);
+            return;
+        }
+#endif
+    }
+
+    // Columns of the sidecar table follow the FTS5 table, c0, c1, ...
+    char *zOptions = sqlite3_mprintf("%Q", table.options.c_str());
+    if (zOptions == nullptr) {
+        sqlite3_result_error_nomem(pCtx);
+        return;
+    }
+    std::string columns, new_values, values;
+    for (size_t i = 0; i < table.columns.size(); i++) {
+        std::string c = "c" + std::to_string(i);
+        std::string value = c, locale;
+        if (external) {
+            char *zCol = sqlite3_mprintf("\"%w\"", table.columns[i].c_str());
+            if (zCol == nullptr) {
+                sqlite3_free(zOptions);
+                sqlite3_result_error_nomem(pCtx);
+                return;
+            }
+            value = zCol;
+            sqlite3_free(zCol);
+        } else if (has_locale) {
+            locale = "l" + std::to_string(i);
+        }
+        columns += ", " + c;
+        new_values += ", " LIBNAME "_offsets(new." + value + ", " + zOptions +
+                      (locale.empty() ? "" : ", new." + locale) + ")";
+        values += ", " LIBNAME "_offsets(" + value + ", " + zOptions + (locale.empty() ? "" : ", " + locale) + ")";
+    }
+    sqlite3_free(zOptions);
+
+    rc = sqlite3_exec(db, "SAVEPOINT " LIBNAME "_offsets", nullptr, nullptr, nullptr);
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error(pCtx, sqlite3_errmsg(db), -1);
+        return;
+    }
+    auto zSchema = table.schema.c_str();
+    auto zName = table.name.c_str();
+    auto zKey = external ? rowid.c_str() : "id";
+    rc = exec_owned(db, sqlite3_mprintf(
+            "DROP TABLE IF EXISTS \"%w\".\"%w_" LIBNAME "_offsets\";"
+            "DROP TRIGGER IF EXISTS \"%w\".\"%w_" LIBNAME "_offsets_ai\";"
+            "DROP TRIGGER IF EXISTS \"%w\".\"%w_" LIBNAME "_offsets_au\";"
+            "DROP TRIGGER IF EXISTS \"%w\".\"%w_" LIBNAME "_offsets_ad\";",
+            zSchema, zName, zSchema, zName, zSchema, zName, zSchema, zName));
+    if (rc == SQLITE_OK) {
+        rc = exec_owned(db, sqlite3_mprintf(
+                "CREATE TABLE \"%w\".\"%w_" LIBNAME "_offsets\"(id INTEGER PRIMARY KEY%s);"
+                "CREATE TRIGGER \"%w\".\"%w_" LIBNAME "_offsets_ai\" AFTER INSERT ON \"%w\" BEGIN "
+                "INSERT OR REPLACE INTO \"%w_" LIBNAME "_offsets\" VALUES(new.\"%w\"%s); END;"
+                "CREATE TRIGGER \"%w\".\"%w_" LIBNAME "_offsets_au\" AFTER UPDATE ON \"%w\" BEGIN "
+                "DELETE FROM \"%w_" LIBNAME "_offsets\" WHERE id = old.\"%w\"; "
+                "INSERT OR REPLACE INTO \"%w_" LIBNAME "_offsets\" VALUES(new.\"%w\"%s); END;"
+                "CREATE TRIGGER \"%w\".\"%w_" LIBNAME "_offsets_ad\" AFTER DELETE ON \"%w\" BEGIN "
+                "DELETE FROM \"%w_" LIBNAME "_offsets\" WHERE id = old.\"%w\"; END;",
+                zSchema, zName, columns.c_str(),
+                zSchema, zName, content.c_str(), zName, zKey, new_values.c_str(),
+                zSchema, zName, content.c_str(), zName, zKey, zName, zKey, new_values.c_str(),
+                zSchema, zName, content.c_str(), zName, zKey));
+    }
+    if (rc == SQLITE_OK) {
+        rc = exec_owned(db, sqlite3_mprintf(
+                "INSERT INTO \"%w\".\"%w_" LIBNAME "_offsets\" SELECT \"%w\"%s FROM \"%w\".\"%w\"",
+                zSchema, zName, zKey, values.c_str(), zSchema, content.c_str()));
+    }
+    if (rc != SQLITE_OK) {
+        // The message is gone once the savepoint is rolled back
+        zErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK TO " LIBNAME "_offsets; RELEASE " LIBNAME "_offsets", nullptr, nullptr, nullptr);
+        sqlite3_result_error(pCtx, zErr != nullptr ? zErr : "out of memory", -1);
+        sqlite3_free(zErr);
+        return;
+    }
+    int nRow = sqlite3_changes(db);
+    sqlite3_exec(db, "RELEASE " LIBNAME "_offsets", nullptr, nullptr, nullptr);
+    sqlite3_result_int(pCtx, nRow);
+}
+
+/**
+ * ngram_offsets_disable(fts_table)
+ *  Drop the sidecar table and the triggers, also those left over by a dropped FTS5 table of the name.
+ */
+static void ngram_offsets_disable_func(sqlite3_context *pCtx, int nVal, sqlite3_value **apVal) {
+    CHECK_EQ(nVal, 1);
+
+    sqlite3 *db = sqlite3_context_db_handle(pCtx);
+    auto zTable = (const char *) sqlite3_value_text(apVal[0]);
+    if (zTable == nullptr) {
+        sqlite3_result_null(pCtx);
+        return;
+    }
+
+    // The FTS5 table may be gone, then the name is taken as typed
+    ngram_fts_table_t table;
+    char *zErr = nullptr;
+    if (ngram_fts_table_find(db, zTable, table, &zErr) != SQLITE_OK) {
+        sqlite3_free(zErr);
+        const char *zDot = strchr(zTable, '.');
+        table.schema = zDot != nullptr ? ngram_tokenizer::String(zTable, zDot - zTable) : "main";
+        table.name = zDot != nullptr ? zDot + 1 : zTable;
+    }
+    auto zSchema = table.schema.c_str();
+    auto zName = table.name.c_str();
+    int rc = exec_owned(db, sqlite3_mprintf(
+            "SAVEPOINT " LIBNAME "_offsets;"
+            "DROP TRIGGER IF EXISTS \"%w\".\"%w_" LIBNAME "_offsets_ai\";"
+            "DROP TRIGGER IF EXISTS \"%w\".\"%w_" LIBNAME "_offsets_au\";"
+            "DROP TRIGGER IF EXISTS \"%w\".\"%w_" LIBNAME "_offsets_ad\";"
+            "DROP TABLE IF EXISTS \"%w\".\"%w_" LIBNAME "_offsets\";"
+            "RELEASE " LIBNAME "_offsets",
+            zSchema, zName, zSchema, zName, zSchema, zName, zSchema, zName));
+    if (rc != SQLITE_OK) {
+        zErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK TO " LIBNAME "_offsets; RELEASE " LIBNAME "_offsets", nullptr, nullptr, nullptr);
+        sqlite3_result_error(pCtx, zErr != nullptr ? zErr : "out of memory", -1);
+        sqlite3_free(zErr);
+        return;
+    }
+    sqlite3_result_null(pCtx);
+}
+
+typedef struct {
+    sqlite3_stmt *pStmt;    /* Reads a row of the sidecar table */
+} sidecar_t;
+
+static void sidecar_delete(void *p) {
+    auto *sidecar = (sidecar_t *) p;
+    sqlite3_finalize(sidecar->pStmt);
+    sqlite3_free(sidecar);
+}
+
+/**
+ * Statement reading the sidecar table of zTable, prepared once per query and kept as auxdata
+ */
+static int sidecar_stmt(const Fts5ExtensionApi *pApi, Fts5Context *pFts, sqlite3_context *pCtx,
+                        const char *zTable, sqlite3_stmt **ppStmt) {
+    auto *sidecar = (sidecar_t *) pApi->xGetAuxdata(pFts, 0);
+    if (sidecar != nullptr) {
+        *ppStmt = sidecar->pStmt;
+        return SQLITE_OK;
+    }
+
+    sidecar = (sidecar_t *) sqlite3_malloc(sizeof(sidecar_t));
+    if (sidecar == nullptr) {
+        return SQLITE_NOMEM;
+    }
+    sidecar->pStmt = nullptr;
+    sqlite3 *db = sqlite3_context_db_handle(pCtx);
+    ngram_fts_table_t table;
+    char *zErr = nullptr;
+    int rc = ngram_fts_table_find(db, zTable, table, &zErr);
+    if (rc == SQLITE_OK) {
+        char *zSql = sqlite3_mprintf("SELECT * FROM \"%w\".\"%w_" LIBNAME "_offsets\" WHERE id = ?",
+                                     table.schema.c_str(), table.name.c_str());
+        rc = zSql != nullptr ? sqlite3_prepare_v2(db, zSql, -1, &sidecar->pStmt, nullptr) : SQLITE_NOMEM;
+        sqlite3_free(zSql);
+    }
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error(pCtx, zErr != nullptr ? zErr : sqlite3_errmsg(db), -1);
+        sqlite3_free(zErr);
+        sidecar_delete(sidecar);
+        return rc;
+    }
+    // FTS5 deletes the auxdata itself if it fails to keep it
+    rc = pApi->xSetAuxdata(pFts, sidecar, sidecar_delete);
+    if (rc == SQLITE_OK) {
+        *ppStmt = sidecar->pStmt;
+    }
+    return rc;
+}
+
+/**
+ * Decode the first nLimit positions of an offsets blob
+ *
+ * @return  false if the blob is missing, malformed or made for another value
+ */
+static bool decode_ranges(const unsigned char *p, int n, int nIn, size_t nLimit,
+                          ngram_tokenizer::Vector<range_t> &ranges) {
+    if (p == nullptr) {
+        return false;
+    }
+    const unsigned char *end = p + n;
+    uint64_t size;
+    if (!get_varint(&p, end, &size) || size != (uint64_t) nIn) {
+        return false;
+    }
+    uint64_t start = 0;
+    while (p < end && ranges.size() < nLimit) {
+        uint64_t delta, len;
+        if (!get_varint(&p, end, &delta) || !get_varint(&p, end, &len)) {
+            return false;
+        }
+        start += delta;
+        if (start > (uint64_t) nIn || len > (uint64_t) nIn - start) {
+            return false;
+        }
+        ranges.push_back(range_t{(int) start, (int) (start + len)});
+    }
+    return true;
+}
+
+typedef struct {
+    ngram_tokenizer::Vector<range_t> *ranges;
+    size_t nLimit;
+} collect_context_t;
+
+static int collect_cb(void *pCtx, int tflags, const char *pToken, int nToken, int iStart, int iEnd) {
+    UNUSED(pToken, nToken);
+
+    auto *collect = (collect_context_t *) pCtx;
+    if (tflags & FTS5_TOKEN_COLOCATED) {
+        return SQLITE_OK;
+    }
+    if (collect->ranges->size() >= collect->nLimit) {
+        return SQLITE_DONE;
+    }
+    try {
+        collect->ranges->push_back(range_t{iStart, iEnd});
+    } catch (const std::bad_alloc &) {
+        return SQLITE_NOMEM;
+    }
+    return SQLITE_OK;
+}
+
+/**
+ * Byte ranges of the first nLimit positions of a column value, from the sidecar row if it is
+ *  there and up to date, otherwise by tokenizing the value again.
+ */
+static int load_ranges(const Fts5ExtensionApi *pApi, Fts5Context *pFts, sqlite3_stmt *pStmt, int iCol,
+                       const char *zIn, int nIn, size_t nLimit, ngram_tokenizer::Vector<range_t> &ranges) {
+    ranges.clear();
+    if (pStmt != nullptr) {
+        sqlite3_bind_int64(pStmt, 1, pApi->xRowid(pFts));
+        bool found = false;
+        if (sqlite3_step(pStmt) == SQLITE_ROW && iCol + 1 < sqlite3_column_count(pStmt)) {
+            auto p = (const unsigned char *) sqlite3_column_blob(pStmt, iCol + 1);
+            int n = sqlite3_column_bytes(pStmt, iCol + 1);
+            found = decode_ranges(p, n, nIn, nLimit, ranges);
+        }
+        int rc = sqlite3_reset(pStmt);
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+        if (found) {
+            ngram_tokenizer::stat_add(ngram_tokenizer::STAT_OFFSETS_HITS, 1);
+            return SQLITE_OK;
+        }
+        ngram_tokenizer::stat_add(ngram_tokenizer::STAT_OFFSETS_MISSES, 1);
+        ranges.clear();
+    }
+
+    collect_context_t collect = {&ranges, nLimit};
+    int rc;
+#if SQLITE_VERSION_NUMBER >= 3047000
+    // In the locale the value was indexed in
+    if (pApi->iVersion >= 4) {
+        const char *pLocale = nullptr;
+        int nLocale = 0;
+        rc = pApi->xColumnLocale(pFts, iCol, &pLocale, &nLocale);
+        if (rc == SQLITE_OK) {
+            rc = pApi->xTokenize_v2(pFts, zIn, nIn, pLocale, nLocale, &collect, collect_cb);
+        }
+        return rc == SQLITE_DONE ? SQLITE_OK : rc;
+    }
+#endif
+    rc = pApi->xTokenize(pFts, zIn, nIn, &collect, collect_cb);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/**
+ * Phrase instances in a column, sorted by their first position
+ */
+static int column_spans(const Fts5ExtensionApi *pApi, Fts5Context *pFts, int iCol,
+                        ngram_tokenizer::Vector<span_t> &spans) {
+    int nInst = 0;
+    int rc = pApi->xInstCount(pFts, &nInst);
+    for (int i = 0; rc == SQLITE_OK && i < nInst; i++) {
+        int iPhrase, iInstCol, iOff;
+        rc = pApi->xInst(pFts, i, &iPhrase, &iInstCol, &iOff);
+        if (rc == SQLITE_OK && iInstCol == iCol) {
+            spans.push_back(span_t{iOff, iOff + pApi->xPhraseSize(pFts, iPhrase) - 1});
+        }
+    }
+    std::sort(spans.begin(), spans.end(), [](const span_t &a, const span_t &b) {
+        return a.first < b.first || (a.first == b.first && a.last < b.last);
+    });
+    return rc;
+}
+
+// End of the bytes of the positions [first, last], grams of different sizes may end in any order
+static int ranges_end(const ngram_tokenizer::Vector<range_t> &ranges, int first, int last) {
+    int iEnd = ranges[first].iEnd;
+    for (int i = first + 1; i <= last; i++) {
+        iEnd = std::max(iEnd, ranges[i].iEnd);
+    }
+    return iEnd;
+}
+
+/**
+ * Append zIn[iFrom, iTo) to out with the phrase instances enclosed by zOpen and zClose
+ *  Instances sharing positions or bytes, as overlapping grams do, are enclosed together.
+ */
+static void append_highlighted(const char *zIn, const ngram_tokenizer::Vector<range_t> &ranges,
+                               const ngram_tokenizer::Vector<span_t> &spans, int iFrom, int iTo,
+                               const char *zOpen, const char *zClose, ngram_tokenizer::String &out) {
+    int nPos = (int) ranges.size();
+    int iOff = iFrom;
+    size_t k = 0;
+    while (k < spans.size() && spans[k].first < nPos) {
+        int last = std::min(spans[k].last, nPos - 1);
+        int iStart = ranges[spans[k].first].iStart;
+        int iEnd = ranges_end(ranges, spans[k].first, last);
+        for (k++; k < spans.size() && spans[k].first < nPos; k++) {
+            if (spans[k].first > last && ranges[spans[k].first].iStart >= iEnd) {
+                break;
+            }
+            int next = std::min(spans[k].last, nPos - 1);
+            iEnd = std::max(iEnd, ranges_end(ranges, spans[k].first, next));
+            last = std::max(last, next);
+        }
+
+        iStart = std::max(iStart, iOff);
+        iEnd = std::min(iEnd, iTo);
+        if (iStart >= iTo) {
+            break;
+        }
+        if (iEnd <= iStart) {
+            continue;
+        }
+        out.append(zIn + iOff, iStart - iOff);
+        out += zOpen;
+        out.append(zIn + iStart, iEnd - iStart);
+        out += zClose;
+        iOff = iEnd;
+    }
+    if (iOff < iTo) {
+        out.append(zIn + iOff, iTo - iOff);
+    }
+}
+
+static const char *value_text(sqlite3_value *pVal) {
+    auto z = (const char *) sqlite3_value_text(pVal);
+    return z != nullptr ? z : "";
+}
+
+/**
+ * ngram_offsets_highlight(fts_table, col, open, close[, sidecar])
+ *  Like highlight(), sidecar is the name of the FTS5 table given to ngram_offsets_enable()
+ *  and saves tokenizing the value again.
+ */
+static void ngram_offsets_highlight_func(
+        const Fts5ExtensionApi *pApi,
+        Fts5Context *pFts,
+        sqlite3_context *pCtx,
+        int nVal,
+        sqlite3_value **apVal) {
+    if (nVal != 3 && nVal != 4) {
+        sqlite3_result_error(pCtx, "wrong number of arguments to function " LIBNAME "_offsets_highlight()", -1);
+        return;
+    }
+
+    int iCol = sqlite3_value_int(apVal[0]);
+    const char *zIn = nullptr;
+    int nIn = 0;
+    int rc = pApi->xColumnText(pFts, iCol, &zIn, &nIn);
+    if (rc != SQLITE_OK || zIn == nullptr) {
+        if (rc != SQLITE_OK) {
+            sqlite3_result_error_code(pCtx, rc);
+        }
+        return;
+    }
+
+    sqlite3_stmt *pStmt = nullptr;
+    if (nVal == 4 && sqlite3_value_type(apVal[3]) != SQLITE_NULL) {
+        rc = sidecar_stmt(pApi, pFts, pCtx, value_text(apVal[3]), &pStmt);
+        if (rc != SQLITE_OK) {
+            if (rc != SQLITE_ERROR) {
+                sqlite3_result_error_code(pCtx, rc);
+            }
+            return;
+        }
+    }
+
+    try {
+        ngram_tokenizer::Vector<span_t> spans;
+        rc = column_spans(pApi, pFts, iCol, spans);
+        ngram_tokenizer::Vector<range_t> ranges;
+        if (rc == SQLITE_OK && !spans.empty()) {
+            int nLimit = 0;
+            for (const auto &span: spans) {
+                nLimit = std::max(nLimit, span.last + 1);
+            }
+            rc = load_ranges(pApi, pFts, pStmt, iCol, zIn, nIn, (size_t) nLimit, ranges);
+        }
+        if (rc == SQLITE_OK) {
+            ngram_tokenizer::String out;
+            append_highlighted(zIn, ranges, spans, 0, nIn, value_text(apVal[1]), value_text(apVal[2]), out);
+            sqlite3_result_text(pCtx, out.data(), (int) out.size(), SQLITE_TRANSIENT);
+        }
+    } catch (const std::bad_alloc &) {
+        rc = SQLITE_NOMEM;
+    }
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error_code(pCtx, rc);
+    }
+}
+
+/**
+ * The column with the most phrase instances, the first column if none has any
+ */
+static int best_column(const Fts5ExtensionApi *pApi, Fts5Context *pFts, int *piCol) {
+    ngram_tokenizer::Vector<int> counts(pApi->xColumnCount(pFts), 0);
+    int nInst = 0;
+    int rc = pApi->xInstCount(pFts, &nInst);
+    for (int i = 0; rc == SQLITE_OK && i < nInst; i++) {
+        int iPhrase, iCol, iOff;
+        rc = pApi->xInst(pFts, i, &iPhrase, &iCol, &iOff);
+        if (rc == SQLITE_OK && iCol >= 0 && iCol < (int) counts.size()) {
+            counts[iCol]++;
+        }
+    }
+    *piCol = (int) (std::max_element(counts.begin(), counts.end()) - counts.begin());
+    return rc;
+}
+
+/**
+ * First position of the window of nToken positions holding the most phrase instances
+ */
+static int best_window(const ngram_tokenizer::Vector<span_t> &spans, int nToken) {
+    if (spans.empty()) {
+        return 0;
+    }
+    size_t best = 0;
+    int best_count = -1;
+    int best_last = 0;
+    for (size_t i = 0; i < spans.size(); i++) {
+        int count = 0;
+        int last = spans[i].first;
+        for (size_t j = i; j < spans.size() && spans[j].first < spans[i].first + nToken; j++) {
+            if (spans[j].last < spans[i].first + nToken) {
+                count++;
+                last = std::max(last, spans[j].last);
+            }
+        }
+        if (count > best_count) {
+            best = i;
+            best_count = count;
+            best_last = last;
+        }
+    }
+    // Center the instances within the window
+    int first = spans[best].first;
+    return std::max(0, first - (nToken - (best_last - first + 1)) / 2);
+}
+
+/**
+ * ngram_snippet(fts_table, col, open, close, ellipsis, tokens[, sidecar])
+ *  Like snippet(), the fragment is the window of tokens positions holding the most phrase instances,
+ *  of the column col or of the column with the most instances if col is negative.
+ */
+static void ngram_snippet_func(
+        const Fts5ExtensionApi *pApi,
+        Fts5Context *pFts,
+        sqlite3_context *pCtx,
+        int nVal,
+        sqlite3_value **apVal) {
+    if (nVal != 5 && nVal != 6) {
+        sqlite3_result_error(pCtx, "wrong number of arguments to function " LIBNAME "_snippet()", -1);
+        return;
+    }
+
+    int iCol = sqlite3_value_int(apVal[0]);
+    int rc = SQLITE_OK;
+    if (iCol < 0) {
+        rc = best_column(pApi, pFts, &iCol);
+        if (rc != SQLITE_OK) {
+            sqlite3_result_error_code(pCtx, rc);
+            return;
+        }
+    }
+    int nToken = std::min(std::max(sqlite3_value_int(apVal[4]), 1), MAX_SNIPPET_TOKENS);
+
+    const char *zIn = nullptr;
+    int nIn = 0;
+    rc = pApi->xColumnText(pFts, iCol, &zIn, &nIn);
+    if (rc != SQLITE_OK || zIn == nullptr) {
+        if (rc != SQLITE_OK) {
+            sqlite3_result_error_code(pCtx, rc);
+        }
+        return;
+    }
+
+    sqlite3_stmt *pStmt = nullptr;
+    if (nVal == 6 && sqlite3_value_type(apVal[5]) != SQLITE_NULL) {
+        rc = sidecar_stmt(pApi, pFts, pCtx, value_text(apVal[5]), &pStmt);
+        if (rc != SQLITE_OK) {
+            if (rc != SQLITE_ERROR) {
+                sqlite3_result_error_code(pCtx, rc);
+            }
+            return;
+        }
+    }
+
+    try {
+        ngram_tokenizer::Vector<span_t> spans;
+        rc = column_spans(pApi, pFts, iCol, spans);
+        int first = best_window(spans, nToken);
+
+        // One more position tells whether the value goes on after the window
+        ngram_tokenizer::Vector<range_t> ranges;
+        if (rc == SQLITE_OK) {
+            rc = load_ranges(pApi, pFts, pStmt, iCol, zIn, nIn, (size_t) (first + nToken + 1), ranges);
+        }
+        if (rc == SQLITE_OK) {
+            ngram_tokenizer::String out;
+            int nPos = (int) ranges.size();
+            if (nPos > 0) {
+                first = std::min(first, nPos - 1);
+                int last = std::min(first + nToken, nPos) - 1;
+                bool more = last + 1 < nPos;
+                int iFrom = first > 0 ? ranges[first].iStart : 0;
+                int iTo = more ? ranges_end(ranges, first, last) : nIn;
+
+                if (first > 0) {
+                    out += value_text(apVal[3]);
+                }
+                append_highlighted(zIn, ranges, spans, iFrom, iTo, value_text(apVal[1]), value_text(apVal[2]), out);
+                if (more) {
+                    out += value_text(apVal[3]);
+                }
+            }
+            sqlite3_result_text(pCtx, out.data(), (int) out.size(), SQLITE_TRANSIENT);
+        }
+    } catch (const std::bad_alloc &) {
+        rc = SQLITE_NOMEM;
+    }
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error_code(pCtx, rc);
+    }
+}
+
+int ngram_offsets_register(sqlite3 *db, fts5_api *pFts5Api) {
+    // Called by the triggers, thus innocuous rather than direct-only
+    int rc = SQLITE_OK;
+    for (int nArg = 2; rc == SQLITE_OK && nArg <= 3; nArg++) {
+        rc = sqlite3_create_function(db, LIBNAME "_offsets", nArg,
+                                     SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS,
+                                     pFts5Api, ngram_offsets_func, nullptr, nullptr);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_create_function(db, LIBNAME "_offsets_enable", 1, SQLITE_UTF8 | SQLITE_DIRECTONLY,
+                                     pFts5Api, ngram_offsets_enable_func, nullptr, nullptr);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_create_function(db, LIBNAME "_offsets_disable", 1, SQLITE_UTF8 | SQLITE_DIRECTONLY,
+                                     nullptr, ngram_offsets_disable_func, nullptr, nullptr);
+    }
+    // Not ngram_highlight, that one of highlight.cpp is in the protobuf build
+    if (rc == SQLITE_OK) {
+        rc = pFts5Api->xCreateFunction(pFts5Api, LIBNAME "_offsets_highlight", nullptr, ngram_offsets_highlight_func,
+                                       nullptr);
+    }
+    if (rc == SQLITE_OK) {
+        rc = pFts5Api->xCreateFunction(pFts5Api, LIBNAME "_snippet", nullptr, ngram_snippet_func, nullptr);
+    }
+    return rc;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "sqlite3ext.h"
+
+/*
+ * ngram_offsets(text, options[, locale]), ngram_offsets_enable(fts_table), ngram_offsets_disable(fts_table)
+ *  Byte ranges of the token positions of a value, recorded at insert time into the sidecar table
+ *  <fts_table>_ngram_offsets, and the auxiliary functions reading them instead of tokenizing again:
+ *
+ *  ngram_offsets_highlight(fts_table, col, open, close[, sidecar])
+ *  ngram_snippet(fts_table, col, open, close, ellipsis, tokens[, sidecar])
+ */
+int ngram_offsets_register(sqlite3 *db, fts5_api *pFts5Api);
@@ -0,0 +1,197 @@
+#include <cstring>
+#include <new>
+#include <strings.h>
+#ifndef DROMOZOA_NO_GOOGLE_LOGGING
+#include <glog/logging.h>
+#else
+#include "common.hpp"
+#endif
+
+#include "phrase_lookup.h"
+#include "tokenizer.h"
+#include "utils.h"
+
+SQLITE_EXTENSION_INIT3
+
+// see:
+//  https://sqlite.org/fts5.html#custom_auxiliary_functions
+//  https://sqlite.org/bindptr.html
+
+#define POSTINGS_POINTER_TYPE   LIBNAME "_postings"
+
+/**
+ * Find the table in a schema, the name is stored as created
+ *
+ * @return  SQLITE_DONE if there is no such table
+ */
+static int find_in_schema(sqlite3 *db, const char *zSchema, const char *zName, ngram_fts_table_t &table) {
+    char *zSql = sqlite3_mprintf(
+            "SELECT name, sql FROM \"%w\".sqlite_master WHERE type = 'table' AND name = ? COLLATE NOCASE", zSchema);
+    if (zSql == nullptr) {
+        return SQLITE_NOMEM;
+    }
+    sqlite3_stmt *pStmt = nullptr;
+    int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, nullptr);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    sqlite3_bind_text(pStmt, 1, zName, -1, SQLITE_STATIC);
+    rc = sqlite3_step(pStmt);
+    if (rc == SQLITE_ROW) {
+        auto zCreate = (const char *) sqlite3_column_text(pStmt, 1);
+        table.schema = zSchema;
+        table.name = (const char *) sqlite3_column_text(pStmt, 0);
+        table.sql = zCreate != nullptr ? zCreate : "";
+    }
+    int rc2 = sqlite3_finalize(pStmt);
+    return rc == SQLITE_ROW || rc == SQLITE_DONE ? (rc2 == SQLITE_OK ? rc : rc2) : rc;
+}
+
+int ngram_fts_table_find(sqlite3 *db, const char *zName, ngram_fts_table_t &table, char **pzErr) {
+    // Schemas in the order SQL resolves an unqualified name
+    sqlite3_stmt *pStmt = nullptr;
+    int rc = sqlite3_prepare_v2(
+            db, "SELECT name FROM pragma_database_list ORDER BY CASE seq WHEN 1 THEN -1 ELSE seq END",
+            -1, &pStmt, nullptr);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    ngram_tokenizer::Vector<ngram_tokenizer::String> schemas;
+    while (sqlite3_step(pStmt) == SQLITE_ROW) {
+        schemas.emplace_back((const char *) sqlite3_column_text(pStmt, 0));
+    }
+    rc = sqlite3_finalize(pStmt);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+
+    // A dot separates the schema only when it names one, a table name may hold a dot as well
+    rc = SQLITE_DONE;
+    const char *zDot = strchr(zName, '.');
+    if (zDot != nullptr) {
+        ngram_tokenizer::String schema(zName, zDot - zName);
+        for (const auto &s: schemas) {
+            if (!strcasecmp(s.c_str(), schema.c_str())) {
+                rc = find_in_schema(db, s.c_str(), zDot + 1, table);
+                break;
+            }
+        }
+    }
+    for (size_t i = 0; rc == SQLITE_DONE && i < schemas.size(); i++) {
+        rc = find_in_schema(db, schemas[i].c_str(), zName, table);
+    }
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        return rc;
+    }
+    if (rc == SQLITE_DONE || !ngram_parse_tokenize_option(table.sql.c_str(), table.options)) {
+        *pzErr = sqlite3_mprintf("%s is not an FTS5 table using the " LIBNAME " tokenizer", zName);
+        return SQLITE_ERROR;
+    }
+
+    rc = sqlite3_prepare_v2(db, "SELECT name FROM pragma_table_info(?, ?) ORDER BY cid", -1, &pStmt, nullptr);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    sqlite3_bind_text(pStmt, 1, table.name.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(pStmt, 2, table.schema.c_str(), -1, SQLITE_STATIC);
+    table.columns.clear();
+    while (sqlite3_step(pStmt) == SQLITE_ROW) {
+        table.columns.emplace_back((const char *) sqlite3_column_text(pStmt, 0));
+    }
+    return sqlite3_finalize(pStmt);
+}
+
+void ngram_append_phrase(const ngram_tokenizer::String &text, bool prefix, ngram_tokenizer::String &out) {
+    if (!out.empty()) {
+        out += ' ';
+    }
+    out += '"';
+    for (char c: text) {
+        out += c;
+        if (c == '"') {
+            out += '"';
+        }
+    }
+    out += '"';
+    if (prefix) {
+        out += '*';
+    }
+}
+
+int ngram_phrase_prepare(sqlite3 *db, const ngram_fts_table_t &table, bool postings, sqlite3_stmt **ppStmt) {
+    auto zSchema = table.schema.c_str();
+    auto zTable = table.name.c_str();
+    char *zSql = postings
+                 ? sqlite3_mprintf("SELECT " LIBNAME "_postings(\"%w\", ?2) FROM \"%w\".\"%w\" WHERE \"%w\" MATCH ?1",
+                                   zTable, zSchema, zTable, zTable)
+                 : sqlite3_mprintf("SELECT count(*) FROM \"%w\".\"%w\" WHERE \"%w\" MATCH ?1",
+                                   zSchema, zTable, zTable);
+    if (zSql == nullptr) {
+        return SQLITE_NOMEM;
+    }
+    int rc = sqlite3_prepare_v2(db, zSql, -1, ppStmt, nullptr);
+    sqlite3_free(zSql);
+    return rc;
+}
+
+int ngram_phrase_docs(sqlite3_stmt *pStmt, const ngram_tokenizer::String &match, sqlite3_int64 *pDocs) {
+    sqlite3_bind_text(pStmt, 1, match.data(), (int) match.size(), SQLITE_STATIC);
+    *pDocs = sqlite3_step(pStmt) == SQLITE_ROW ? sqlite3_column_int64(pStmt, 0) : 0;
+    return sqlite3_reset(pStmt);
+}
+
+int ngram_phrase_postings(sqlite3_stmt *pStmt, const ngram_tokenizer::String &match,
+                          ngram_tokenizer::Vector<ngram_posting_t> &postings) {
+    sqlite3_bind_text(pStmt, 1, match.data(), (int) match.size(), SQLITE_STATIC);
+    sqlite3_bind_pointer(pStmt, 2, &postings, POSTINGS_POINTER_TYPE, nullptr);
+    while (sqlite3_step(pStmt) == SQLITE_ROW) {}
+    // The pointer is only valid during this call
+    int rc = sqlite3_reset(pStmt);
+    sqlite3_bind_null(pStmt, 2);
+    return rc;
+}
+
+/**
+ * Append the columns of the current row holding the first phrase, instances come in column order
+ */
+static void postings_func(
+        const Fts5ExtensionApi *pApi,
+        Fts5Context *pFts,
+        sqlite3_context *pCtx,
+        int nVal,
+        sqlite3_value **apVal) {
+    auto *postings = (ngram_tokenizer::Vector<ngram_posting_t> *) (
+            nVal == 1 ? sqlite3_value_pointer(apVal[0], POSTINGS_POINTER_TYPE) : nullptr);
+    if (postings == nullptr) {
+        sqlite3_result_error(pCtx, LIBNAME "_postings() is internal to " LIBNAME "_similar()", -1);
+        return;
+    }
+
+    int nInst = 0;
+    int rc = pApi->xInstCount(pFts, &nInst);
+    try {
+        for (int i = 0; rc == SQLITE_OK && i < nInst; i++) {
+            int iPhrase, iCol, iOff;
+            rc = pApi->xInst(pFts, i, &iPhrase, &iCol, &iOff);
+            if (rc != SQLITE_OK || iPhrase != 0) {
+                continue;
+            }
+            ngram_posting_t posting{pApi->xRowid(pFts), iCol};
+            if (postings->empty() || !(postings->back() == posting)) {
+                postings->push_back(posting);
+            }
+        }
+    } catch (const std::bad_alloc &) {
+        rc = SQLITE_NOMEM;
+    }
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error_code(pCtx, rc);
+        return;
+    }
+    sqlite3_result_null(pCtx);
+}
+
+int ngram_phrase_register(fts5_api *pFts5Api) {
+    return pFts5Api->xCreateFunction(pFts5Api, LIBNAME "_postings", nullptr, postings_func, nullptr);
+}
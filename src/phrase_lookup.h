@@ -0,0 +1,70 @@
+#pragma once
+
+#include "sqlite3ext.h"
+
+#include "allocator.h"
+
+/*
+ * Rows of a phrase of an FTS5 table of the ngram tokenizer, shared by ngram_similar() and ngram_query()
+ *  The rows are read with a MATCH on the table itself, so no fts5vocab table is created
+ *  and the schema is never changed by a query.
+ */
+
+// A column value of a row
+typedef struct {
+    sqlite3_int64 doc;
+    int col;
+} ngram_posting_t;
+
+static inline bool operator<(const ngram_posting_t &a, const ngram_posting_t &b) {
+    return a.doc < b.doc || (a.doc == b.doc && a.col < b.col);
+}
+
+static inline bool operator==(const ngram_posting_t &a, const ngram_posting_t &b) {
+    return a.doc == b.doc && a.col == b.col;
+}
+
+typedef struct {
+    ngram_tokenizer::String schema;
+    ngram_tokenizer::String name;       /* As created, which may differ in case from the name given */
+    ngram_tokenizer::String sql;        /* CREATE VIRTUAL TABLE statement */
+    ngram_tokenizer::String options;    /* Arguments of the ngram tokenizer */
+    ngram_tokenizer::Vector<ngram_tokenizer::String> columns;
+} ngram_fts_table_t;
+
+/**
+ * Find an FTS5 table of the ngram tokenizer by a name, qualified by its schema or not
+ *  Names are matched without case as SQL does, an unqualified one is searched in temp, main and then
+ *  the attached databases.
+ *
+ * @return  SQLITE_ERROR with *pzErr set, if there is no such table
+ */
+int ngram_fts_table_find(sqlite3 *db, const char *zName, ngram_fts_table_t &table, char **pzErr);
+
+/**
+ * Append the text as a phrase of a MATCH expression, a prefix query if prefix is set
+ */
+void ngram_append_phrase(const ngram_tokenizer::String &text, bool prefix, ngram_tokenizer::String &out);
+
+/**
+ * Prepare the statement of ngram_phrase_docs() or ngram_phrase_postings()
+ */
+int ngram_phrase_prepare(sqlite3 *db, const ngram_fts_table_t &table, bool postings, sqlite3_stmt **ppStmt);
+
+/**
+ * Number of rows matching the MATCH expression
+ */
+int ngram_phrase_docs(sqlite3_stmt *pStmt, const ngram_tokenizer::String &match, sqlite3_int64 *pDocs);
+
+/**
+ * Column values matching the MATCH expression of a single phrase, in row and column order
+ *  The table should be detail=full, as the columns come from the phrase instances.
+ */
+int ngram_phrase_postings(sqlite3_stmt *pStmt, const ngram_tokenizer::String &match,
+                          ngram_tokenizer::Vector<ngram_posting_t> &postings);
+
+/*
+ * ngram_postings(fts_table, collector)
+ *  Auxiliary function of ngram_phrase_postings(), the collector is bound with sqlite3_bind_pointer().
+ */
+int ngram_phrase_register(fts5_api *pFts5Api);
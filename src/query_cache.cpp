@@ -0,0 +1,66 @@
+#include "query_cache.h"
+
+#include <utility>
+
+#include "stats.h"
+
+namespace ngram_tokenizer {
+    // Longer queries are rare and unlikely to repeat
+#define MAX_QUERY_BYTES     1024
+
+    void QueryCache::Entry::add(int tflags, const char *pToken, int nToken, int iStart, int iEnd) {
+        tokens.push_back(CachedToken{tflags, (int) terms.size(), nToken, iStart, iEnd});
+        terms.append(pToken, nToken);
+    }
+
+    QueryCache::QueryCache() : capacity(0) {
+    }
+
+    QueryCache::~QueryCache() = default;
+
+    void QueryCache::set_capacity(size_t n) {
+        capacity = n;
+        while (entries.size() > capacity) {
+            entries.erase(lru.back());
+            lru.pop_back();
+        }
+    }
+
+    bool QueryCache::accepts(size_t n) const {
+        return capacity > 0 && n <= MAX_QUERY_BYTES;
+    }
+
+    // The flags are part of the key, e.g. a prefix query yields other tokens than a phrase
+    String QueryCache::make_key(int flags, const char *p, size_t n) {
+        String key;
+        key.reserve(n + 1);
+        key += (char) flags;
+        key.append(p, n);
+        return key;
+    }
+
+    const QueryCache::Entry *QueryCache::find(int flags, const char *p, size_t n) {
+        auto found = entries.find(make_key(flags, p, n));
+        if (found == entries.end()) {
+            stat_add(STAT_QUERY_CACHE_MISSES, 1);
+            return nullptr;
+        }
+        stat_add(STAT_QUERY_CACHE_HITS, 1);
+        lru.splice(lru.begin(), lru, found->second.lru);
+        return &found->second.entry;
+    }
+
+    void QueryCache::insert(int flags, const char *p, size_t n, Entry &&entry) {
+        String key = make_key(flags, p, n);
+        if (entries.find(key) != entries.end()) {
+            return;
+        }
+        if (entries.size() >= capacity) {
+            entries.erase(lru.back());
+            lru.pop_back();
+        }
+        lru.push_front(key);
+        Slot slot{std::move(entry), lru.begin()};
+        entries.emplace(std::move(key), std::move(slot));
+    }
+}
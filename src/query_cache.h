@@ -0,0 +1,75 @@
+/**
+ * LRU cache of the tokens emitted for query strings
+ *
+ * see: LICENSE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <map>
+
+#include "allocator.h"
+
+namespace ngram_tokenizer {
+    /**
+     * FTS5 tokenizes the MATCH string every time a statement is prepared, and applications tend to
+     *  issue the same short queries over and over. The tokens of a query are recorded once and
+     *  replayed afterwards, skipping the UTF-8 validation and the segmentation.
+     */
+    class QueryCache {
+    public:
+        struct CachedToken {
+            int tflags;
+            int offset;         /* Offset of the token in Entry::terms */
+            int length;
+            int iStart;
+            int iEnd;
+        };
+
+        struct Entry {
+            void add(int tflags, const char *pToken, int nToken, int iStart, int iEnd);
+
+            String terms;       /* Bytes of all the tokens */
+            Vector<CachedToken> tokens;
+        };
+
+        QueryCache();
+
+        ~QueryCache();
+
+        QueryCache(const QueryCache &) = delete;
+
+        QueryCache &operator=(const QueryCache &) = delete;
+
+        // 0 disables the cache
+        void set_capacity(size_t);
+
+        // Whether a query of the size is worth caching
+        bool accepts(size_t) const;
+
+        // Look up a query, a hit becomes the most recently used entry
+        const Entry *find(int flags, const char *, size_t);
+
+        // Add the tokens of a query, evicting the least recently used entry if full
+        void insert(int flags, const char *, size_t, Entry &&);
+
+    private:
+        typedef std::list<String, Allocator<String>> lru_t;
+
+        struct Slot {
+            Entry entry;
+            lru_t::iterator lru;
+        };
+
+        typedef std::map<String, Slot, std::less<String>, Allocator<std::pair<const String, Slot>>> map_t;
+
+        static String make_key(int flags, const char *, size_t);
+
+        size_t capacity;
+        map_t entries;
+        lru_t lru;              /* Keys, most recently used first */
+    };
+}
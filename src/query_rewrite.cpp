@@ -0,0 +1,302 @@
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <new>
+#ifndef DROMOZOA_NO_GOOGLE_LOGGING
+#include <glog/logging.h>
+#else
+#include "common.hpp"
+#endif
+
+#include "phrase_lookup.h"
+#include "query_rewrite.h"
+#include "tokenizer.h"
+#include "utils.h"
+
+SQLITE_EXTENSION_INIT3
+
+// see:
+//  https://sqlite.org/fts5.html#full_text_query_syntax
+
+typedef struct {
+    ngram_tokenizer::String text;       /* The word as typed */
+    ngram_tokenizer::Vector<ngram_tokenizer::String> grams;     /* Query grams of the word */
+    ngram_tokenizer::String first;      /* Text of the first gram, the term may be compact */
+    bool colocated;     /* Some gram has synonyms, the grams are not a plain sequence */
+    bool prefix;        /* Shorter than a gram, searched by a prefix query */
+    bool dropped;       /* Implied by another phrase */
+    sqlite3_int64 docs; /* Rows the phrase matches */
+} query_phrase_t;
+
+/*
+ * Per statement state of a table, kept as auxdata of the table name
+ */
+typedef struct {
+    Fts5Tokenizer *pTok;
+    int ngram;
+    sqlite3_stmt *pDocs;        /* Rows matching a phrase */
+} query_table_t;
+
+static void query_table_delete(void *p) {
+    auto *table = (query_table_t *) p;
+    sqlite3_finalize(table->pDocs);
+    if (table->pTok != nullptr) {
+        ngram_cb_delete(table->pTok);
+    }
+    sqlite3_free(table);
+}
+
+static void query_error(sqlite3_context *pCtx, const char *zFormat, const char *zArg) {
+    char *zErr = sqlite3_mprintf(zFormat, zArg);
+    sqlite3_result_error(pCtx, zErr != nullptr ? zErr : "out of memory", -1);
+    sqlite3_free(zErr);
+}
+
+/**
+ * Tokenizer and row count statement of zTable
+ *
+ * @return  nullptr after setting the error of pCtx
+ */
+static query_table_t *query_table_open(sqlite3_context *pCtx, const char *zTable) {
+    sqlite3 *db = sqlite3_context_db_handle(pCtx);
+    auto *table = (query_table_t *) sqlite3_malloc(sizeof(query_table_t));
+    if (table == nullptr) {
+        sqlite3_result_error_nomem(pCtx);
+        return nullptr;
+    }
+    memset(table, 0, sizeof(query_table_t));
+
+    ngram_fts_table_t fts;
+    char *zErr = nullptr;
+    int rc = ngram_fts_table_find(db, zTable, fts, &zErr);
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error(pCtx, zErr != nullptr ? zErr : sqlite3_errmsg(db), -1);
+        sqlite3_free(zErr);
+        query_table_delete(table);
+        return nullptr;
+    }
+
+    auto *pFts5Api = (fts5_api *) sqlite3_user_data(pCtx);
+    if (ngram_cb_create_options(pFts5Api, fts.options.c_str(), &table->pTok) != SQLITE_OK) {
+        query_error(pCtx, "invalid " LIBNAME " tokenizer options: %s", fts.options.c_str());
+        query_table_delete(table);
+        return nullptr;
+    }
+    table->ngram = ((ngram_context_t *) table->pTok)->options.ngram;
+
+    rc = ngram_phrase_prepare(db, fts, false, &table->pDocs);
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error(pCtx, rc == SQLITE_NOMEM ? "out of memory" : sqlite3_errmsg(db), -1);
+        query_table_delete(table);
+        return nullptr;
+    }
+    return table;
+}
+
+static int gram_collect_cb(void *pCtx, int tflags, const char *pToken, int nToken, int iStart, int iEnd) {
+    auto *phrase = (query_phrase_t *) pCtx;
+    if (tflags & FTS5_TOKEN_COLOCATED) {
+        phrase->colocated = true;
+        return SQLITE_OK;
+    }
+    // Delegate tokenizers call back from C frames, nothing may unwind through them
+    try {
+        if (phrase->grams.empty()) {
+            phrase->first.assign(phrase->text, iStart, iEnd - iStart);
+        }
+        phrase->grams.emplace_back(pToken, nToken);
+    } catch (const std::bad_alloc &) {
+        return SQLITE_NOMEM;
+    }
+    return SQLITE_OK;
+}
+
+// Whitespace between words, including the ideographic space of CJK input methods
+static size_t space_length(const char *p, const char *end) {
+    if (isspace((unsigned char) *p)) {
+        return 1;
+    }
+    if (end - p >= 3 && !memcmp(p, "\xE3\x80\x80", 3)) {
+        return 3;
+    }
+    return 0;
+}
+
+static size_t utf8_length(const ngram_tokenizer::String &s) {
+    size_t n = 0;
+    for (char c: s) {
+        n += ((unsigned char) c & 0xC0) != 0x80;
+    }
+    return n;
+}
+
+static bool has_non_ascii(const ngram_tokenizer::String &s) {
+    for (char c: s) {
+        if ((unsigned char) c >= 0x80) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool starts_with(const ngram_tokenizer::String &s, const ngram_tokenizer::String &prefix) {
+    return s.size() >= prefix.size() && !s.compare(0, prefix.size(), prefix);
+}
+
+/**
+ * Whether every row matching phrase b also matches phrase a
+ *  A phrase matches the grams of another one when they are a contiguous part of them,
+ *  a prefix query when one of the grams starts with its term.
+ */
+static bool implies(const query_phrase_t &b, const query_phrase_t &a) {
+    if (a.colocated || b.colocated) {
+        return false;
+    }
+    if (a.prefix) {
+        for (const auto &gram: b.grams) {
+            if (starts_with(gram, a.grams[0])) {
+                return true;
+            }
+        }
+        return false;
+    }
+    return !b.prefix && std::search(b.grams.begin(), b.grams.end(), a.grams.begin(), a.grams.end()) != b.grams.end();
+}
+
+/**
+ * Rows matching a phrase, the phrase is queried as it is written into the expression
+ */
+static int count_docs(query_table_t *table, query_phrase_t &phrase) {
+    ngram_tokenizer::String match;
+    ngram_append_phrase(phrase.text, phrase.prefix, match);
+    return ngram_phrase_docs(table->pDocs, match, &phrase.docs);
+}
+
+static int rewrite_query(query_table_t *table, const char *p, int n, ngram_tokenizer::String &out) {
+    const char *end = p + n;
+    ngram_tokenizer::Vector<query_phrase_t> phrases;
+    while (p < end) {
+        size_t len;
+        while (p < end && (len = space_length(p, end)) > 0) {
+            p += len;
+        }
+        const char *q = p;
+        while (q < end && space_length(q, end) == 0) {
+            q++;
+        }
+        if (q == p) {
+            break;
+        }
+
+        query_phrase_t phrase;
+        phrase.text.assign(p, q - p);
+        phrase.colocated = phrase.prefix = phrase.dropped = false;
+        phrase.docs = -1;
+        p = q;
+        // A word shorter than a gram is only the start of the grams indexed, a prefix query
+        //  tokenizes it as its first window alone
+        int rc = ngram_cb_tokenize(table->pTok, &phrase, FTS5_TOKENIZE_QUERY | FTS5_TOKENIZE_PREFIX,
+                                   phrase.text.data(), (int) phrase.text.size(), gram_collect_cb);
+        phrase.prefix = phrase.grams.size() == 1 && !phrase.colocated && has_non_ascii(phrase.first) &&
+                        utf8_length(phrase.first) < (size_t) table->ngram;
+        if (rc == SQLITE_OK && !phrase.prefix) {
+            phrase.grams.clear();
+            phrase.colocated = false;
+            rc = ngram_cb_tokenize(table->pTok, &phrase, FTS5_TOKENIZE_QUERY,
+                                   phrase.text.data(), (int) phrase.text.size(), gram_collect_cb);
+        }
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+        // Punctuation alone is no term at all
+        if (phrase.grams.empty()) {
+            continue;
+        }
+        phrases.push_back(std::move(phrase));
+    }
+
+    // Of the same phrases, the first one is kept
+    for (size_t i = 0; i < phrases.size(); i++) {
+        for (size_t j = 0; j < phrases.size() && !phrases[i].dropped; j++) {
+            if (j == i || phrases[j].dropped || !implies(phrases[j], phrases[i])) {
+                continue;
+            }
+            phrases[i].dropped = j < i || !implies(phrases[i], phrases[j]);
+        }
+    }
+    phrases.erase(std::remove_if(phrases.begin(), phrases.end(), [](const query_phrase_t &phrase) {
+        return phrase.dropped;
+    }), phrases.end());
+
+    for (auto &phrase: phrases) {
+        int rc = count_docs(table, phrase);
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+        // Nothing matches the whole query either, one phrase is enough to tell
+        if (phrase.docs == 0) {
+            ngram_append_phrase(phrase.text, phrase.prefix, out);
+            return SQLITE_OK;
+        }
+    }
+    // The rarest phrase first
+    std::stable_sort(phrases.begin(), phrases.end(), [](const query_phrase_t &a, const query_phrase_t &b) {
+        return a.docs < b.docs;
+    });
+    for (const auto &phrase: phrases) {
+        ngram_append_phrase(phrase.text, phrase.prefix, out);
+    }
+    return SQLITE_OK;
+}
+
+/**
+ * ngram_query(fts_table, text)
+ *
+ * @return  the MATCH expression, NULL if the text has no term
+ */
+static void ngram_query_func(sqlite3_context *pCtx, int nVal, sqlite3_value **apVal) {
+    CHECK_EQ(nVal, 2);
+
+    auto zTable = (const char *) sqlite3_value_text(apVal[0]);
+    auto zText = (const char *) sqlite3_value_text(apVal[1]);
+    if (zTable == nullptr || zText == nullptr) {
+        sqlite3_result_null(pCtx);
+        return;
+    }
+
+    int rc;
+    try {
+        auto *table = (query_table_t *) sqlite3_get_auxdata(pCtx, 0);
+        bool cached = table != nullptr;
+        std::unique_ptr<query_table_t, void (*)(void *)> guard(nullptr, query_table_delete);
+        if (!cached) {
+            if ((table = query_table_open(pCtx, zTable)) == nullptr) {
+                return;
+            }
+            guard.reset(table);
+        }
+
+        ngram_tokenizer::String out;
+        rc = rewrite_query(table, zText, sqlite3_value_bytes(apVal[1]), out);
+        if (rc == SQLITE_OK) {
+            if (out.empty()) {
+                sqlite3_result_null(pCtx);
+            } else {
+                sqlite3_result_text(pCtx, out.data(), (int) out.size(), SQLITE_TRANSIENT);
+            }
+        }
+        if (!cached) {
+            sqlite3_set_auxdata(pCtx, 0, guard.release(), query_table_delete);
+        }
+    } catch (const std::bad_alloc &) {
+        rc = SQLITE_NOMEM;
+    }
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error_code(pCtx, rc);
+    }
+}
+
+int ngram_query_register(sqlite3 *db, fts5_api *pFts5Api) {
+    return sqlite3_create_function(db, LIBNAME "_query", 2, SQLITE_UTF8,
+                                   pFts5Api, ngram_query_func, nullptr, nullptr);
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "sqlite3ext.h"
+
+/*
+ * ngram_query(fts_table, text)
+ *  Rewrite the text a user typed into a MATCH expression for the table: every word a quoted phrase,
+ *  words shorter than a gram prefix queries, implied phrases dropped and the rarest phrase first.
+ */
+int ngram_query_register(sqlite3 *db, fts5_api *pFts5Api);
@@ -0,0 +1,131 @@
+#include <cmath>
+#ifndef DROMOZOA_NO_GOOGLE_LOGGING
+#include <glog/logging.h>
+#else
+#include "common.hpp"
+#endif
+
+#include "rank.h"
+#include "utils.h"
+
+SQLITE_EXTENSION_INIT3
+
+// see:
+//  https://sqlite.org/fts5.html#custom_auxiliary_functions
+//  https://github.com/sqlite/sqlite/blob/master/ext/fts5/fts5_aux.c (fts5Bm25Function)
+
+#define BM25_K1         1.2
+#define BM25_B          0.75
+
+/*
+ * Statistics of the query, the same for every row thus computed once.
+ *  A phrase is what the user typed, e.g. 東京タワー, no matter how many grams it is indexed as.
+ */
+typedef struct {
+    int nPhrase;
+    double avgdl;           /* Average number of tokens per row */
+    double *aIDF;           /* IDF of each phrase */
+    double *aFreq;          /* Per row, weighted instances of each phrase */
+} rank_query_t;
+
+static int count_rows_cb(const Fts5ExtensionApi *pApi, Fts5Context *pFts, void *pUserData) {
+    UNUSED(pApi, pFts);
+
+    (*(sqlite3_int64 *) pUserData)++;
+    return SQLITE_OK;
+}
+
+/**
+ * Count the rows of each phrase and keep the result as auxdata of the query
+ */
+static int rank_query(const Fts5ExtensionApi *pApi, Fts5Context *pFts, rank_query_t **ppQuery) {
+    auto *query = (rank_query_t *) pApi->xGetAuxdata(pFts, 0);
+    if (query != nullptr) {
+        *ppQuery = query;
+        return SQLITE_OK;
+    }
+
+    int nPhrase = pApi->xPhraseCount(pFts);
+    sqlite3_int64 nByte = sizeof(rank_query_t) + 2 * nPhrase * sizeof(double);
+    query = (rank_query_t *) sqlite3_malloc64(nByte);
+    if (query == nullptr) {
+        return SQLITE_NOMEM;
+    }
+    query->nPhrase = nPhrase;
+    query->aIDF = (double *) &query[1];
+    query->aFreq = query->aIDF + nPhrase;
+
+    sqlite3_int64 nRow = 0;
+    sqlite3_int64 nToken = 0;
+    int rc = pApi->xRowCount(pFts, &nRow);
+    if (rc == SQLITE_OK) {
+        rc = pApi->xColumnTotalSize(pFts, -1, &nToken);
+    }
+    query->avgdl = nRow > 0 ? (double) nToken / (double) nRow : 1;
+
+    for (int i = 0; rc == SQLITE_OK && i < nPhrase; i++) {
+        sqlite3_int64 nHit = 0;
+        rc = pApi->xQueryPhrase(pFts, i, (void *) &nHit, count_rows_cb);
+        // Stays positive when the phrase is in more than half of the rows, where bm25() clamps it to 1e-6
+        query->aIDF[i] = log(1 + ((double) (nRow - nHit) + 0.5) / ((double) nHit + 0.5));
+        DLOG(INFO) << "phrase: " << i << " rows: " << nHit << " idf: " << query->aIDF[i];
+    }
+
+    if (rc == SQLITE_OK) {
+        rc = pApi->xSetAuxdata(pFts, query, sqlite3_free);
+    } else {
+        sqlite3_free(query);
+    }
+    if (rc == SQLITE_OK) {
+        *ppQuery = query;
+    }
+    return rc;
+}
+
+/**
+ * The arguments are optional column weights, 1.0 for a missing one, as for bm25().
+ *  Like bm25() the result is negated, so better matches sort first by ORDER BY rank.
+ */
+void ngram_rank(
+        const Fts5ExtensionApi *pApi,
+        Fts5Context *pFts,
+        sqlite3_context *pCtx,
+        int nVal,
+        sqlite3_value **apVal) {
+    rank_query_t *query = nullptr;
+    int rc = rank_query(pApi, pFts, &query);
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error_code(pCtx, rc);
+        return;
+    }
+
+    // Only the phrase instances of the row are walked, the grams inside a phrase are never looked at
+    for (int i = 0; i < query->nPhrase; i++) {
+        query->aFreq[i] = 0;
+        Fts5PhraseIter iter;
+        int iCol, iOff;
+        rc = pApi->xPhraseFirst(pFts, i, &iter, &iCol, &iOff);
+        if (rc != SQLITE_OK) {
+            sqlite3_result_error_code(pCtx, rc);
+            return;
+        }
+        for (; iCol >= 0; pApi->xPhraseNext(pFts, &iter, &iCol, &iOff)) {
+            query->aFreq[i] += iCol < nVal ? sqlite3_value_double(apVal[iCol]) : 1.0;
+        }
+    }
+
+    int nToken = 0;
+    rc = pApi->xColumnSize(pFts, -1, &nToken);
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error_code(pCtx, rc);
+        return;
+    }
+    double norm = BM25_K1 * (1 - BM25_B + BM25_B * (double) nToken / query->avgdl);
+
+    double score = 0;
+    for (int i = 0; i < query->nPhrase; i++) {
+        double freq = query->aFreq[i];
+        score += query->aIDF[i] * freq * (BM25_K1 + 1) / (freq + norm);
+    }
+    sqlite3_result_double(pCtx, -score);
+}
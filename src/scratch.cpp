@@ -0,0 +1,70 @@
+#include "scratch.h"
+
+#include <algorithm>
+#include <new>
+
+#include "stats.h"
+
+namespace ngram_tokenizer {
+    // Every IDLE_CALLS calls, a buffer using less than 1 / IDLE_RATIO of its capacity is shrunk
+#define IDLE_CALLS      256
+#define IDLE_RATIO      4
+    // Never bother shrinking buffers smaller than this
+#define MIN_SHRINK_BYTES    4096
+
+    Scratch::Scratch() : peak_tokens(0), peak_gram(0), peak_fold(0), calls(0), bytes(0) {
+    }
+
+    Scratch::~Scratch() {
+        stat_add(STAT_SCRATCH_BYTES, -(int64_t) bytes);
+    }
+
+    void Scratch::begin() {
+        tokens.clear();
+        gram.clear();
+        fold.clear();
+    }
+
+    void Scratch::end() {
+        peak_tokens = std::max(peak_tokens, tokens.size());
+        peak_gram = std::max(peak_gram, gram.size());
+        peak_fold = std::max(peak_fold, fold.size());
+
+        if (++calls >= IDLE_CALLS) {
+            shrink();
+            peak_tokens = 0;
+            peak_gram = 0;
+            peak_fold = 0;
+            calls = 0;
+        }
+
+        size_t n = get_bytes();
+        if (n != bytes) {
+            stat_add(STAT_SCRATCH_BYTES, (int64_t) n - (int64_t) bytes);
+            bytes = n;
+        }
+    }
+
+    size_t Scratch::get_bytes() const {
+        return tokens.capacity() * sizeof(Token) + gram.capacity() + fold.capacity();
+    }
+
+    template<typename T>
+    static inline void shrink_to(T &buffer, size_t peak, size_t size) {
+        if (buffer.capacity() * size >= MIN_SHRINK_BYTES && peak * IDLE_RATIO < buffer.capacity()) {
+            try {
+                T t;
+                t.reserve(peak);
+                buffer.swap(t);
+            } catch (const std::bad_alloc &) {
+                // Keep the larger buffer then
+            }
+        }
+    }
+
+    void Scratch::shrink() {
+        shrink_to(tokens, peak_tokens, sizeof(Token));
+        shrink_to(gram, peak_gram, 1);
+        shrink_to(fold, peak_fold, 1);
+    }
+}
@@ -0,0 +1,51 @@
+/**
+ * Buffers reused by every xTokenize() call of a tokenizer instance
+ *
+ * see: LICENSE.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+#include "allocator.h"
+#include "token_vector.h"
+
+namespace ngram_tokenizer {
+    /**
+     * The buffers grow to the high-water mark of the texts seen so far, so the steady state
+     *  of ingestion does not call the allocator at all. When the recent calls only used a
+     *  small part of a buffer for a while, it is shrunk back to what they needed.
+     */
+    class Scratch {
+    public:
+        Scratch();
+
+        ~Scratch();
+
+        Scratch(const Scratch &) = delete;
+
+        Scratch &operator=(const Scratch &) = delete;
+
+        // Call at the start of every xTokenize(), the buffers are emptied but keep their capacity
+        void begin();
+
+        // Call at the end of every xTokenize(), even a failed one
+        void end();
+
+        size_t get_bytes() const;
+
+        Vector<Token> tokens;   /* Character offsets of the input text */
+        String gram;            /* Gram being emitted */
+        String fold;            /* Gram after case folding or compact encoding */
+
+    private:
+        void shrink();
+
+        size_t peak_tokens;
+        size_t peak_gram;
+        size_t peak_fold;
+        int calls;
+        size_t bytes;           /* Last value accounted in STAT_SCRATCH_BYTES */
+    };
+}
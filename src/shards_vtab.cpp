@@ -0,0 +1,1060 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdarg>
+#include <cstring>
+#include <new>
+#include <system_error>
+#include <thread>
+#ifndef DROMOZOA_NO_GOOGLE_LOGGING
+#include <glog/logging.h>
+#else
+#include "common.hpp"
+#endif
+
+#include "shards_vtab.h"
+#include "tokenizer.h"
+#include "utils.h"
+
+SQLITE_EXTENSION_INIT3
+
+// see:
+//  https://sqlite.org/vtab.html
+//  https://sqlite.org/fts5.html#sorting_by_auxiliary_function_results
+//  https://github.com/sqlite/sqlite/blob/master/ext/fts5/fts5_aux.c (fts5Bm25Function)
+
+#define SHARDS_BUSY_TIMEOUT_MS  5000
+
+#define STATS_POINTER_TYPE      LIBNAME "_shard_stats"
+
+// Parameters of bm25(), as FTS5 has them
+#define BM25_K1                 1.2
+#define BM25_B                  0.75
+
+// Bits of idxNum, the arguments are passed to xFilter() in this order
+#define SHARDS_IDX_MATCH        0x01
+#define SHARDS_IDX_LIMIT        0x02
+#define SHARDS_IDX_OFFSET       0x04
+#define SHARDS_IDX_ROWID        0x08
+
+typedef struct {
+    ngram_tokenizer::String schema;
+    ngram_tokenizer::String filename;
+    sqlite3 *reader;            /* Connection of the searches, opened by the first one */
+    sqlite3_stmt *pInsert;      /* On the connection of the table, within its transactions */
+    sqlite3_stmt *pDelete;
+} shard_t;
+
+typedef struct {
+    sqlite3_vtab base;
+    sqlite3 *db;
+    ngram_tokenizer::String table;      /* Name of the FTS5 table in every shard */
+    ngram_tokenizer::Vector<ngram_tokenizer::String> columns;
+    ngram_tokenizer::Vector<shard_t> shards;
+    sqlite3_int64 next_rowid;   /* Of an insert without rowid, 0 until read in the transaction */
+} shards_vtab;
+
+typedef struct {
+    sqlite3_int64 rowid;
+    double rank;
+    ngram_tokenizer::Vector<sqlite3_value *> values;    /* Empty if the row is gone */
+} shard_row_t;
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    bool scan;                  /* Rows of pScan rather than of rows */
+    ngram_tokenizer::Vector<shard_row_t> rows;      /* Merged rows of MATCH */
+    size_t i;
+    sqlite3_stmt *pScan;        /* Rows of the shard iShard, on the connection of the table */
+    size_t iShard;
+    size_t nShard;              /* End of the shards to scan */
+    bool lookup;                /* By iRowid */
+    sqlite3_int64 iRowid;
+} shards_cursor;
+
+/*
+ * Result of the search on one shard, filled by the auxiliary function ngram_shard_stats()
+ *  Only the statistics of bm25() are kept for every match, the values are read for the top rows.
+ */
+typedef struct {
+    bool counted;               /* The statistics of the shard are read */
+    bool totals_only;           /* Only rows and tokens, of a shard without matches */
+    sqlite3_int64 nRow;
+    sqlite3_int64 nToken;
+    ngram_tokenizer::Vector<sqlite3_int64> aHit;    /* Rows of each phrase */
+    ngram_tokenizer::Vector<sqlite3_int64> rowids;  /* Of the matches */
+    ngram_tokenizer::Vector<int> sizes;             /* Tokens of each match */
+    ngram_tokenizer::Vector<int> freqs;             /* Instances of each phrase in each match */
+    int rc;
+    ngram_tokenizer::String error;
+} shard_result_t;
+
+// A match among the top rows of all the shards
+typedef struct {
+    double rank;
+    size_t shard;
+    size_t hit;
+} shard_pick_t;
+
+static void shards_error(sqlite3_vtab *pVtab, const char *zFormat, ...) {
+    va_list ap;
+    va_start(ap, zFormat);
+    sqlite3_free(pVtab->zErrMsg);
+    pVtab->zErrMsg = sqlite3_vmprintf(zFormat, ap);
+    va_end(ap);
+}
+
+static void free_rows(ngram_tokenizer::Vector<shard_row_t> &rows) {
+    for (auto &row: rows) {
+        for (auto *value: row.values) {
+            sqlite3_value_free(value);
+        }
+    }
+    rows.clear();
+}
+
+static int count_rows_cb(const Fts5ExtensionApi *pApi, Fts5Context *pFts, void *pUserData) {
+    UNUSED(pApi, pFts);
+
+    (*(sqlite3_int64 *) pUserData)++;
+    return SQLITE_OK;
+}
+
+/**
+ * Read the rows and tokens of the shard, and the rows of each phrase of the query
+ */
+static int shard_count(const Fts5ExtensionApi *pApi, Fts5Context *pFts, shard_result_t *result) {
+    int rc = pApi->xRowCount(pFts, &result->nRow);
+    if (rc == SQLITE_OK) {
+        rc = pApi->xColumnTotalSize(pFts, -1, &result->nToken);
+    }
+    result->aHit.assign(result->totals_only ? 0 : (size_t) pApi->xPhraseCount(pFts), 0);
+    for (size_t i = 0; rc == SQLITE_OK && i < result->aHit.size(); i++) {
+        rc = pApi->xQueryPhrase(pFts, (int) i, (void *) &result->aHit[i], count_rows_cb);
+    }
+    result->counted = rc == SQLITE_OK;
+    return rc;
+}
+
+/**
+ * ngram_shard_stats(fts_table, result)
+ *  Append the tokens of the current row and the instances of each phrase in it, as bm25() reads them.
+ *  The result is bound with sqlite3_bind_pointer().
+ */
+static void shard_stats_func(
+        const Fts5ExtensionApi *pApi,
+        Fts5Context *pFts,
+        sqlite3_context *pCtx,
+        int nVal,
+        sqlite3_value **apVal) {
+    auto *result = (shard_result_t *) (nVal == 1 ? sqlite3_value_pointer(apVal[0], STATS_POINTER_TYPE) : nullptr);
+    if (result == nullptr) {
+        sqlite3_result_error(pCtx, LIBNAME "_shard_stats() is internal to " LIBNAME "_shards", -1);
+        return;
+    }
+
+    int rc = SQLITE_OK;
+    if (!result->counted) {
+        rc = shard_count(pApi, pFts, result);
+    }
+    if (rc == SQLITE_OK && !result->totals_only) {
+        try {
+            int nToken = 0;
+            int nInst = 0;
+            rc = pApi->xColumnSize(pFts, -1, &nToken);
+            if (rc == SQLITE_OK) {
+                rc = pApi->xInstCount(pFts, &nInst);
+            }
+            size_t base = result->freqs.size();
+            result->freqs.resize(base + result->aHit.size(), 0);
+            for (int i = 0; rc == SQLITE_OK && i < nInst; i++) {
+                int iPhrase, iCol, iOff;
+                rc = pApi->xInst(pFts, i, &iPhrase, &iCol, &iOff);
+                if (rc == SQLITE_OK) {
+                    result->freqs[base + iPhrase]++;
+                }
+            }
+            result->rowids.push_back(pApi->xRowid(pFts));
+            result->sizes.push_back(nToken);
+        } catch (const std::bad_alloc &) {
+            rc = SQLITE_NOMEM;
+        }
+    }
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error_code(pCtx, rc);
+        return;
+    }
+    sqlite3_result_null(pCtx);
+}
+
+/**
+ * Shard of a rowid, consecutive rowids are spread over the shards by the splitmix64 finalizer
+ *  The count of shards is part of the layout, changing it needs the rows to be moved.
+ */
+static size_t shard_of(sqlite3_int64 rowid, size_t nShard) {
+    auto x = (uint64_t) rowid;
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return (size_t) (x % nShard);
+}
+
+// Module arguments are taken as typed, with or without quotes
+static void dequote_arg(const char *z, ngram_tokenizer::String &out) {
+    out.clear();
+    while (*z && isspace((unsigned char) *z)) z++;
+    char quote = *z;
+    if (quote != '\'' && quote != '"' && quote != '`' && quote != '[') {
+        out = z;
+        while (!out.empty() && isspace((unsigned char) out.back())) {
+            out.pop_back();
+        }
+        return;
+    }
+    char close = quote == '[' ? ']' : quote;
+    for (z++; *z; z++) {
+        if (*z == close) {
+            if (z[1] != close || quote == '[') {
+                break;
+            }
+            z++;
+        }
+        out += *z;
+    }
+}
+
+/**
+ * Check that the shard holds an FTS5 table of the ngram tokenizer, and read its columns
+ */
+static int shard_table_info(sqlite3 *db, const char *zSchema, const char *zTable,
+                            ngram_tokenizer::Vector<ngram_tokenizer::String> &columns, char **pzErr) {
+    char *zSql = sqlite3_mprintf("SELECT sql FROM \"%w\".sqlite_master WHERE type = 'table' AND name = ?", zSchema);
+    if (zSql == nullptr) {
+        return SQLITE_NOMEM;
+    }
+    sqlite3_stmt *pStmt = nullptr;
+    int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, nullptr);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+        *pzErr = sqlite3_mprintf("no such shard: %s", zSchema);
+        return rc;
+    }
+    sqlite3_bind_text(pStmt, 1, zTable, -1, SQLITE_STATIC);
+    ngram_tokenizer::String options;
+    bool found = false;
+    if (sqlite3_step(pStmt) == SQLITE_ROW) {
+        auto zCreate = (const char *) sqlite3_column_text(pStmt, 0);
+        found = zCreate != nullptr && ngram_parse_tokenize_option(zCreate, options);
+    }
+    sqlite3_finalize(pStmt);
+    if (!found) {
+        *pzErr = sqlite3_mprintf("%s.%s is not an FTS5 table using the " LIBNAME " tokenizer", zSchema, zTable);
+        return SQLITE_ERROR;
+    }
+
+    rc = sqlite3_prepare_v2(db, "SELECT name FROM pragma_table_info(?, ?)", -1, &pStmt, nullptr);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    sqlite3_bind_text(pStmt, 1, zTable, -1, SQLITE_STATIC);
+    sqlite3_bind_text(pStmt, 2, zSchema, -1, SQLITE_STATIC);
+    while (sqlite3_step(pStmt) == SQLITE_ROW) {
+        columns.emplace_back((const char *) sqlite3_column_text(pStmt, 0));
+    }
+    return sqlite3_finalize(pStmt);
+}
+
+static int shards_disconnect(sqlite3_vtab *pVtab) {
+    auto *vtab = (shards_vtab *) pVtab;
+    for (auto &shard: vtab->shards) {
+        sqlite3_finalize(shard.pInsert);
+        sqlite3_finalize(shard.pDelete);
+        sqlite3_close(shard.reader);
+    }
+    vtab->~shards_vtab();
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+static int shards_connect_impl(sqlite3 *db, int argc, const char *const *argv, sqlite3_vtab **ppVtab, char **pzErr) {
+    if (argc < 5) {
+        *pzErr = sqlite3_mprintf("usage: " LIBNAME "_shards(fts_table, shard_schema, ...)");
+        return SQLITE_ERROR;
+    }
+
+    void *mem = sqlite3_malloc(sizeof(shards_vtab));
+    if (mem == nullptr) {
+        return SQLITE_NOMEM;
+    }
+    auto *vtab = new(mem) shards_vtab();
+    vtab->db = db;
+    dequote_arg(argv[3], vtab->table);
+
+    int rc = SQLITE_OK;
+    for (int i = 4; rc == SQLITE_OK && i < argc; i++) {
+        shard_t shard{};
+        dequote_arg(argv[i], shard.schema);
+        ngram_tokenizer::Vector<ngram_tokenizer::String> columns;
+        rc = shard_table_info(db, shard.schema.c_str(), vtab->table.c_str(), columns, pzErr);
+        if (rc != SQLITE_OK) {
+            break;
+        }
+        if (vtab->shards.empty()) {
+            vtab->columns = columns;
+        } else if (columns != vtab->columns) {
+            *pzErr = sqlite3_mprintf("%s.%s has other columns than the first shard",
+                                     shard.schema.c_str(), vtab->table.c_str());
+            rc = SQLITE_ERROR;
+            break;
+        }
+        // Searches read the shard through connections of their own
+        const char *zFilename = sqlite3_db_filename(db, shard.schema.c_str());
+        if (zFilename == nullptr || zFilename[0] == '\0') {
+            *pzErr = sqlite3_mprintf("shard %s is not a database file", shard.schema.c_str());
+            rc = SQLITE_ERROR;
+            break;
+        }
+        shard.filename = zFilename;
+        vtab->shards.push_back(std::move(shard));
+    }
+
+    // The columns of the shards, then the hidden columns of MATCH and rank as in FTS5
+    if (rc == SQLITE_OK) {
+        ngram_tokenizer::String decl = "CREATE TABLE x(";
+        for (const auto &column: vtab->columns) {
+            char *z = sqlite3_mprintf("\"%w\", ", column.c_str());
+            if (z == nullptr) {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            decl += z;
+            sqlite3_free(z);
+        }
+        char *z = sqlite3_mprintf("\"%w\" HIDDEN, rank HIDDEN)", argv[2]);
+        if (z == nullptr) {
+            rc = SQLITE_NOMEM;
+        }
+        if (rc == SQLITE_OK) {
+            decl += z;
+            rc = sqlite3_declare_vtab(db, decl.c_str());
+        }
+        sqlite3_free(z);
+    }
+    if (rc != SQLITE_OK) {
+        shards_disconnect(&vtab->base);
+        return rc;
+    }
+
+    *ppVtab = &vtab->base;
+    return SQLITE_OK;
+}
+
+static int shards_connect(
+        sqlite3 *db,
+        void *pAux,
+        int argc,
+        const char *const *argv,
+        sqlite3_vtab **ppVtab,
+        char **pzErr) {
+    UNUSED(pAux);
+
+    try {
+        return shards_connect_impl(db, argc, argv, ppVtab, pzErr);
+    } catch (const std::bad_alloc &) {
+        return SQLITE_NOMEM;
+    }
+}
+
+static int shards_best_index(sqlite3_vtab *pVtab, sqlite3_index_info *pInfo) {
+    auto *vtab = (shards_vtab *) pVtab;
+    int nCol = (int) vtab->columns.size();
+
+    int iMatch = -1, iLimit = -1, iOffset = -1, iRowid = -1;
+    for (int i = 0; i < pInfo->nConstraint; i++) {
+        const auto &c = pInfo->aConstraint[i];
+        if (!c.usable) {
+            continue;
+        }
+        if (c.op == SQLITE_INDEX_CONSTRAINT_MATCH && c.iColumn == nCol) {
+            iMatch = i;
+        } else if (c.op == SQLITE_INDEX_CONSTRAINT_EQ && c.iColumn < 0) {
+            iRowid = i;
+#ifdef SQLITE_INDEX_CONSTRAINT_LIMIT
+        } else if (c.op == SQLITE_INDEX_CONSTRAINT_LIMIT) {
+            iLimit = i;
+        } else if (c.op == SQLITE_INDEX_CONSTRAINT_OFFSET) {
+            iOffset = i;
+#endif
+        }
+    }
+
+    int argvIndex = 0;
+    pInfo->idxNum = 0;
+    if (iMatch >= 0) {
+        pInfo->idxNum |= SHARDS_IDX_MATCH;
+        pInfo->aConstraintUsage[iMatch].argvIndex = ++argvIndex;
+        pInfo->aConstraintUsage[iMatch].omit = 1;
+
+        // Rows come out by rank, so the top rows of each shard are enough for a LIMIT.
+        //  SQLite still applies LIMIT and OFFSET itself, thus they are not omitted.
+        bool by_rank = pInfo->nOrderBy == 0 ||
+                       (pInfo->nOrderBy == 1 && pInfo->aOrderBy[0].iColumn == nCol + 1 && !pInfo->aOrderBy[0].desc);
+        if (by_rank) {
+            pInfo->orderByConsumed = pInfo->nOrderBy == 1;
+            if (iLimit >= 0) {
+                pInfo->idxNum |= SHARDS_IDX_LIMIT;
+                pInfo->aConstraintUsage[iLimit].argvIndex = ++argvIndex;
+                if (iOffset >= 0) {
+                    pInfo->idxNum |= SHARDS_IDX_OFFSET;
+                    pInfo->aConstraintUsage[iOffset].argvIndex = ++argvIndex;
+                }
+            }
+        }
+        pInfo->estimatedCost = 1e3;
+        pInfo->estimatedRows = 100;
+    } else if (iRowid >= 0) {
+        pInfo->idxNum |= SHARDS_IDX_ROWID;
+        pInfo->aConstraintUsage[iRowid].argvIndex = ++argvIndex;
+        pInfo->aConstraintUsage[iRowid].omit = 1;
+        pInfo->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+        pInfo->estimatedCost = 10;
+        pInfo->estimatedRows = 1;
+    } else {
+        pInfo->estimatedCost = 1e9;
+        pInfo->estimatedRows = 1000000;
+    }
+    return SQLITE_OK;
+}
+
+static int prepare_owned(sqlite3 *db, char *zSql, sqlite3_stmt **ppStmt) {
+    if (zSql == nullptr) {
+        return SQLITE_NOMEM;
+    }
+    int rc = sqlite3_prepare_v2(db, zSql, -1, ppStmt, nullptr);
+    sqlite3_free(zSql);
+    return rc;
+}
+
+static int step_once(sqlite3_stmt *pStmt) {
+    sqlite3_step(pStmt);
+    return sqlite3_reset(pStmt);
+}
+
+static int shards_open(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor) {
+    UNUSED(pVtab);
+
+    void *mem = sqlite3_malloc(sizeof(shards_cursor));
+    if (mem == nullptr) {
+        return SQLITE_NOMEM;
+    }
+    auto *cur = new(mem) shards_cursor{};
+
+    *ppCursor = &cur->base;
+    return SQLITE_OK;
+}
+
+static void shards_reset(shards_cursor *cur) {
+    free_rows(cur->rows);
+    cur->i = 0;
+    sqlite3_finalize(cur->pScan);
+    cur->pScan = nullptr;
+    cur->scan = false;
+}
+
+static int shards_close(sqlite3_vtab_cursor *pCursor) {
+    auto *cur = (shards_cursor *) pCursor;
+    shards_reset(cur);
+    cur->~shards_cursor();
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+static int shard_stats_register(fts5_api *pFts5Api) {
+    return pFts5Api->xCreateFunction(pFts5Api, LIBNAME "_shard_stats", nullptr, shard_stats_func, nullptr);
+}
+
+/**
+ * Connection of the searches on a shard, opened by the first one
+ */
+static int shard_reader(shard_t *shard, shard_result_t *result) {
+    if (shard->reader != nullptr) {
+        return SQLITE_OK;
+    }
+    sqlite3 *reader = nullptr;
+    int rc = ngram_open_worker(shard->filename.c_str(), SQLITE_OPEN_READONLY, &reader);
+    if (rc != SQLITE_OK) {
+        result->error = reader != nullptr ? sqlite3_errmsg(reader) : sqlite3_errstr(rc);
+        sqlite3_close(reader);
+        return rc;
+    }
+    // The ranks are read by a function of this module, which the worker connection lacks
+    fts5_api *pFts5Api = ngram_fts5_api(reader);
+    rc = pFts5Api != nullptr ? shard_stats_register(pFts5Api) : sqlite3_errcode(reader);
+    if (rc != SQLITE_OK) {
+        result->error = sqlite3_errmsg(reader);
+        sqlite3_close(reader);
+        return rc;
+    }
+    // Waits for the commits of the writers, which hold the lock only briefly
+    sqlite3_busy_timeout(reader, SHARDS_BUSY_TIMEOUT_MS);
+    shard->reader = reader;
+    return SQLITE_OK;
+}
+
+/**
+ * Run MATCH on one shard, for the statistics of bm25() of the shard and of every match
+ *  On a worker thread the reader connection of the shard is used, by one thread at a time.
+ *  db is the connection of the table instead when it has written to the shard in its transaction.
+ */
+static void shard_search(shard_t *shard, sqlite3 *db, const shards_vtab *vtab, const ngram_tokenizer::String &query,
+                         shard_result_t *result) {
+    result->rc = SQLITE_OK;
+    if (db == nullptr) {
+        result->rc = shard_reader(shard, result);
+        if (result->rc != SQLITE_OK) {
+            return;
+        }
+        db = shard->reader;
+    }
+
+    const char *zSchema = db == shard->reader ? "main" : shard->schema.c_str();
+    const char *zTable = vtab->table.c_str();
+    sqlite3_stmt *pStmt = nullptr;
+    int rc = prepare_owned(db, sqlite3_mprintf(
+            "SELECT " LIBNAME "_shard_stats(\"%w\", ?2) FROM \"%w\".\"%w\" WHERE \"%w\" MATCH ?1",
+            zTable, zSchema, zTable, zTable), &pStmt);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_text(pStmt, 1, query.data(), (int) query.size(), SQLITE_STATIC);
+        sqlite3_bind_pointer(pStmt, 2, result, STATS_POINTER_TYPE, nullptr);
+        while (sqlite3_step(pStmt) == SQLITE_ROW) {}
+        rc = sqlite3_finalize(pStmt);
+    }
+
+    // The rows of a shard without matches still count, the function reads them on any row of a scan
+    if (rc == SQLITE_OK && !result->counted) {
+        result->totals_only = true;
+        rc = prepare_owned(db, sqlite3_mprintf("SELECT " LIBNAME "_shard_stats(\"%w\", ?1) FROM \"%w\".\"%w\" LIMIT 1",
+                                               zTable, zSchema, zTable), &pStmt);
+        if (rc == SQLITE_OK) {
+            sqlite3_bind_pointer(pStmt, 1, result, STATS_POINTER_TYPE, nullptr);
+            while (sqlite3_step(pStmt) == SQLITE_ROW) {}
+            rc = sqlite3_finalize(pStmt);
+        }
+    }
+    if (rc != SQLITE_OK) {
+        result->rc = rc;
+        result->error = rc == SQLITE_NOMEM ? sqlite3_errstr(rc) : sqlite3_errmsg(db);
+    }
+}
+
+/**
+ * Read the values of the picked rows of one shard into their slots, on the connection that searched it
+ */
+static void shard_fetch(shard_t *shard, sqlite3 *db, const shards_vtab *vtab,
+                        const ngram_tokenizer::Vector<size_t> &picks, ngram_tokenizer::Vector<shard_row_t> &slots,
+                        shard_result_t *result) {
+    result->rc = SQLITE_OK;
+    if (picks.empty()) {
+        return;
+    }
+    if (db == nullptr) {
+        db = shard->reader;
+    }
+
+    const char *zSchema = db == shard->reader ? "main" : shard->schema.c_str();
+    sqlite3_stmt *pStmt = nullptr;
+    int rc = prepare_owned(db, sqlite3_mprintf("SELECT * FROM \"%w\".\"%w\" WHERE rowid = ?",
+                                               zSchema, vtab->table.c_str()), &pStmt);
+    int nCol = (int) vtab->columns.size();
+    try {
+        for (size_t i = 0; rc == SQLITE_OK && i < picks.size(); i++) {
+            // A row deleted since the search by another connection is left out
+            shard_row_t &row = slots[picks[i]];
+            sqlite3_bind_int64(pStmt, 1, row.rowid);
+            if (sqlite3_step(pStmt) == SQLITE_ROW) {
+                for (int j = 0; j < nCol; j++) {
+                    sqlite3_value *value = sqlite3_value_dup(sqlite3_column_value(pStmt, j));
+                    if (value == nullptr) {
+                        rc = SQLITE_NOMEM;
+                        break;
+                    }
+                    row.values.push_back(value);
+                }
+            }
+            int rc2 = sqlite3_reset(pStmt);
+            if (rc == SQLITE_OK) {
+                rc = rc2;
+            }
+        }
+    } catch (const std::bad_alloc &) {
+        // Never leaves a worker thread
+        rc = SQLITE_NOMEM;
+    }
+    sqlite3_finalize(pStmt);
+    if (rc != SQLITE_OK) {
+        result->rc = rc;
+        result->error = rc == SQLITE_NOMEM ? sqlite3_errstr(rc) : sqlite3_errmsg(db);
+    }
+}
+
+/**
+ * Run fn(k, db) for every shard k at once, db is the connection of the table or nullptr for the reader
+ *  A shard written in the transaction of the table is run on its connection, the readers only see
+ *  committed rows. The rest is spread over worker threads.
+ */
+template<typename Fn>
+static void shards_parallel(shards_vtab *vtab, Fn fn) {
+    size_t nShard = vtab->shards.size();
+    ngram_tokenizer::Vector<size_t> tasks;
+    ngram_tokenizer::Vector<size_t> local;
+    for (size_t i = 0; i < nShard; i++) {
+        if (sqlite3_txn_state(vtab->db, vtab->shards[i].schema.c_str()) == SQLITE_TXN_WRITE) {
+            local.push_back(i);
+        } else {
+            tasks.push_back(i);
+        }
+    }
+
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next++) < tasks.size()) {
+            fn(tasks[i], (sqlite3 *) nullptr);
+        }
+    };
+    // At least two, a search waits for the disk as much as for the CPU
+    size_t nThread = 0;
+    if (sqlite3_threadsafe() && !tasks.empty()) {
+        nThread = std::min<size_t>(tasks.size(), std::max(2u, std::thread::hardware_concurrency())) - 1;
+    }
+    // Reserved up front, a reallocation failing after some threads started would drop joinable threads
+    ngram_tokenizer::Vector<std::thread> threads;
+    threads.reserve(nThread);
+    for (size_t i = 0; i < nThread; i++) {
+        try {
+            threads.emplace_back(worker);
+        } catch (const std::system_error &e) {
+            LOG(ERROR) << "Cannot start a shard worker: " << e.what();
+            break;
+        }
+    }
+    for (auto k: local) {
+        fn(k, vtab->db);
+    }
+    worker();
+    for (auto &t: threads) {
+        t.join();
+    }
+}
+
+static int shards_check(shards_vtab *vtab, const ngram_tokenizer::Vector<shard_result_t> &results) {
+    for (size_t k = 0; k < results.size(); k++) {
+        if (results[k].rc != SQLITE_OK) {
+            shards_error(&vtab->base, "shard %s: %s", vtab->shards[k].schema.c_str(), results[k].error.c_str());
+            return results[k].rc;
+        }
+    }
+    return SQLITE_OK;
+}
+
+/**
+ * Rank every match by bm25() over the statistics of all the shards, as FTS5 ranks the rows of one table
+ *  Column weights are 1.0, a rank configured on the tables of the shards is not used.
+ *  A phrase counts its rows in every shard that matched the query, thus with AND, NOT or NEAR a shard
+ *  without any match leaves out its rows of the phrases.
+ */
+static void shards_rank(const ngram_tokenizer::Vector<shard_result_t> &results,
+                        ngram_tokenizer::Vector<shard_pick_t> &picks) {
+    sqlite3_int64 nRow = 0;
+    sqlite3_int64 nToken = 0;
+    size_t nPhrase = 0;
+    for (const auto &result: results) {
+        nRow += result.nRow;
+        nToken += result.nToken;
+        nPhrase = std::max(nPhrase, result.aHit.size());
+    }
+    double avgdl = nRow > 0 ? (double) nToken / (double) nRow : 1;
+
+    ngram_tokenizer::Vector<double> aIDF(nPhrase);
+    for (size_t i = 0; i < nPhrase; i++) {
+        sqlite3_int64 nHit = 0;
+        for (const auto &result: results) {
+            nHit += i < result.aHit.size() ? result.aHit[i] : 0;
+        }
+        double idf = log((double) (nRow - nHit) + 0.5) - log((double) nHit + 0.5);
+        aIDF[i] = idf <= 0 ? 1e-6 : idf;
+    }
+
+    for (size_t k = 0; k < results.size(); k++) {
+        const auto &result = results[k];
+        for (size_t j = 0; j < result.rowids.size(); j++) {
+            const int *aFreq = result.freqs.data() + j * result.aHit.size();
+            double D = (double) result.sizes[j];
+            double score = 0;
+            for (size_t i = 0; i < result.aHit.size(); i++) {
+                score += aIDF[i] * ((aFreq[i] * (BM25_K1 + 1.0)) / (aFreq[i] + BM25_K1 * (1 - BM25_B + BM25_B * D / avgdl)));
+            }
+            picks.push_back(shard_pick_t{-1.0 * score, k, j});
+        }
+    }
+}
+
+/**
+ * MATCH on all the shards at once, then the top rows of them by rank
+ *  The matches of every shard are ranked over the statistics of all of them, then only the values
+ *  of the top nLimit rows are read.
+ */
+static int shards_match(shards_vtab *vtab, shards_cursor *cur, const ngram_tokenizer::String &query,
+                        sqlite3_int64 nLimit) {
+    size_t nShard = vtab->shards.size();
+    ngram_tokenizer::Vector<shard_result_t> results(nShard);
+    shards_parallel(vtab, [&](size_t k, sqlite3 *db) {
+        shard_search(&vtab->shards[k], db, vtab, query, &results[k]);
+    });
+    int rc = shards_check(vtab, results);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+
+    // Lower ranks first as FTS5 sorts them
+    ngram_tokenizer::Vector<shard_pick_t> picks;
+    shards_rank(results, picks);
+    std::stable_sort(picks.begin(), picks.end(), [](const shard_pick_t &a, const shard_pick_t &b) {
+        return a.rank < b.rank;
+    });
+    if (nLimit >= 0 && picks.size() > (size_t) nLimit) {
+        picks.resize((size_t) nLimit);
+    }
+
+    // Each shard reads its rows into their slots, in the order of the ranks
+    cur->rows.reserve(picks.size());
+    ngram_tokenizer::Vector<shard_row_t> slots(picks.size());
+    ngram_tokenizer::Vector<ngram_tokenizer::Vector<size_t>> by_shard(nShard);
+    for (size_t i = 0; i < picks.size(); i++) {
+        slots[i].rowid = results[picks[i].shard].rowids[picks[i].hit];
+        slots[i].rank = picks[i].rank;
+        by_shard[picks[i].shard].push_back(i);
+    }
+    shards_parallel(vtab, [&](size_t k, sqlite3 *db) {
+        shard_fetch(&vtab->shards[k], db, vtab, by_shard[k], slots, &results[k]);
+    });
+    rc = shards_check(vtab, results);
+    if (rc != SQLITE_OK) {
+        free_rows(slots);
+        return rc;
+    }
+    for (auto &row: slots) {
+        if (!row.values.empty()) {
+            cur->rows.push_back(std::move(row));
+        }
+    }
+    return SQLITE_OK;
+}
+
+/**
+ * Step the scan of the shards, one statement at a time on the connection of the table
+ *  Rows are read as they are stepped, and the transaction of the connection sees its own writes.
+ */
+static int shards_scan_step(shards_vtab *vtab, shards_cursor *cur) {
+    while (true) {
+        if (cur->pScan == nullptr) {
+            if (cur->iShard >= cur->nShard) {
+                return SQLITE_OK;
+            }
+            const shard_t &shard = vtab->shards[cur->iShard];
+            int rc = prepare_owned(vtab->db, sqlite3_mprintf("SELECT rowid, * FROM \"%w\".\"%w\"%s",
+                                                             shard.schema.c_str(), vtab->table.c_str(),
+                                                             cur->lookup ? " WHERE rowid = ?" : ""), &cur->pScan);
+            if (rc != SQLITE_OK) {
+                shards_error(&vtab->base, "shard %s: %s", shard.schema.c_str(), sqlite3_errmsg(vtab->db));
+                return rc;
+            }
+            sqlite3_bind_int64(cur->pScan, 1, cur->iRowid);
+        }
+        if (sqlite3_step(cur->pScan) == SQLITE_ROW) {
+            return SQLITE_OK;
+        }
+        int rc = sqlite3_finalize(cur->pScan);
+        cur->pScan = nullptr;
+        if (rc != SQLITE_OK) {
+            shards_error(&vtab->base, "shard %s: %s", vtab->shards[cur->iShard].schema.c_str(),
+                         sqlite3_errmsg(vtab->db));
+            return rc;
+        }
+        cur->iShard++;
+    }
+}
+
+static int shards_filter(
+        sqlite3_vtab_cursor *pCursor,
+        int idxNum,
+        const char *idxStr,
+        int argc,
+        sqlite3_value **argv) {
+    UNUSED(idxStr, argc);
+
+    auto *cur = (shards_cursor *) pCursor;
+    auto *vtab = (shards_vtab *) pCursor->pVtab;
+    shards_reset(cur);
+
+    if (!(idxNum & SHARDS_IDX_MATCH)) {
+        // A rowid only lives in its own shard
+        cur->scan = true;
+        cur->lookup = (idxNum & SHARDS_IDX_ROWID) != 0;
+        cur->iShard = 0;
+        cur->nShard = vtab->shards.size();
+        if (cur->lookup) {
+            if (sqlite3_value_numeric_type(argv[0]) != SQLITE_INTEGER) {
+                cur->iShard = cur->nShard;
+                return SQLITE_OK;
+            }
+            cur->iRowid = sqlite3_value_int64(argv[0]);
+            cur->iShard = shard_of(cur->iRowid, vtab->shards.size());
+            cur->nShard = cur->iShard + 1;
+        }
+        return shards_scan_step(vtab, cur);
+    }
+
+    try {
+        int j = 0;
+        auto zQuery = (const char *) sqlite3_value_text(argv[j]);
+        if (zQuery == nullptr) {
+            return SQLITE_OK;
+        }
+        ngram_tokenizer::String query(zQuery, sqlite3_value_bytes(argv[j++]));
+        // Every shard may hold all of the top rows, each one returns LIMIT + OFFSET of them
+        sqlite3_int64 nLimit = -1;
+        if (idxNum & SHARDS_IDX_LIMIT) {
+            nLimit = sqlite3_value_int64(argv[j++]);
+            if (nLimit >= 0 && (idxNum & SHARDS_IDX_OFFSET)) {
+                nLimit += std::max<sqlite3_int64>(sqlite3_value_int64(argv[j++]), 0);
+            }
+        }
+        int rc = shards_match(vtab, cur, query, nLimit);
+        if (rc != SQLITE_OK) {
+            free_rows(cur->rows);
+        }
+        return rc;
+    } catch (const std::bad_alloc &) {
+        free_rows(cur->rows);
+        return SQLITE_NOMEM;
+    }
+}
+
+static int shards_next(sqlite3_vtab_cursor *pCursor) {
+    auto *cur = (shards_cursor *) pCursor;
+    if (cur->scan) {
+        return shards_scan_step((shards_vtab *) pCursor->pVtab, cur);
+    }
+    cur->i++;
+    return SQLITE_OK;
+}
+
+static int shards_eof(sqlite3_vtab_cursor *pCursor) {
+    auto *cur = (shards_cursor *) pCursor;
+    return cur->scan ? cur->pScan == nullptr : cur->i >= cur->rows.size();
+}
+
+static int shards_column(sqlite3_vtab_cursor *pCursor, sqlite3_context *pCtx, int i) {
+    auto *cur = (shards_cursor *) pCursor;
+    int nCol = (int) ((shards_vtab *) pCursor->pVtab)->columns.size();
+    if (cur->scan) {
+        // Scans have no rank
+        if (i < nCol) {
+            sqlite3_result_value(pCtx, sqlite3_column_value(cur->pScan, 1 + i));
+        } else {
+            sqlite3_result_null(pCtx);
+        }
+        return SQLITE_OK;
+    }
+    const auto &row = cur->rows[cur->i];
+    if (i < nCol) {
+        sqlite3_result_value(pCtx, row.values[i]);
+    } else if (i == nCol + 1) {
+        sqlite3_result_double(pCtx, row.rank);
+    } else {
+        // The hidden column of MATCH
+        sqlite3_result_null(pCtx);
+    }
+    return SQLITE_OK;
+}
+
+static int shards_rowid(sqlite3_vtab_cursor *pCursor, sqlite_int64 *pRowid) {
+    auto *cur = (shards_cursor *) pCursor;
+    *pRowid = cur->scan ? sqlite3_column_int64(cur->pScan, 0) : cur->rows[cur->i].rowid;
+    return SQLITE_OK;
+}
+
+static int shard_delete(shards_vtab *vtab, sqlite3_int64 rowid) {
+    shard_t &shard = vtab->shards[shard_of(rowid, vtab->shards.size())];
+    if (shard.pDelete == nullptr) {
+        int rc = prepare_owned(vtab->db, sqlite3_mprintf("DELETE FROM \"%w\".\"%w\" WHERE rowid = ?",
+                                                         shard.schema.c_str(), vtab->table.c_str()), &shard.pDelete);
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+    }
+    sqlite3_bind_int64(shard.pDelete, 1, rowid);
+    return step_once(shard.pDelete);
+}
+
+static int shard_insert(shards_vtab *vtab, sqlite3_int64 rowid, sqlite3_value **apValue) {
+    shard_t &shard = vtab->shards[shard_of(rowid, vtab->shards.size())];
+    if (shard.pInsert == nullptr) {
+        ngram_tokenizer::String columns = "rowid";
+        ngram_tokenizer::String values = "?";
+        for (const auto &column: vtab->columns) {
+            char *z = sqlite3_mprintf(", \"%w\"", column.c_str());
+            if (z == nullptr) {
+                return SQLITE_NOMEM;
+            }
+            columns += z;
+            values += ", ?";
+            sqlite3_free(z);
+        }
+        int rc = prepare_owned(vtab->db, sqlite3_mprintf("INSERT INTO \"%w\".\"%w\"(%s) VALUES(%s)",
+                                                         shard.schema.c_str(), vtab->table.c_str(),
+                                                         columns.c_str(), values.c_str()), &shard.pInsert);
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+    }
+    sqlite3_bind_int64(shard.pInsert, 1, rowid);
+    for (size_t i = 0; i < vtab->columns.size(); i++) {
+        sqlite3_bind_value(shard.pInsert, (int) i + 2, apValue[i]);
+    }
+    int rc = step_once(shard.pInsert);
+    sqlite3_clear_bindings(shard.pInsert);
+    return rc;
+}
+
+/**
+ * Rowid of an insert without one, after the largest rowid of all shards
+ *  Read once per transaction, no other connection inserts in between.
+ */
+static int shards_next_rowid(shards_vtab *vtab, sqlite3_int64 *pRowid) {
+    if (vtab->next_rowid == 0) {
+        sqlite3_int64 last = 0;
+        for (const auto &shard: vtab->shards) {
+            sqlite3_stmt *pStmt = nullptr;
+            int rc = prepare_owned(vtab->db, sqlite3_mprintf("SELECT rowid FROM \"%w\".\"%w\" ORDER BY rowid DESC LIMIT 1",
+                                                             shard.schema.c_str(), vtab->table.c_str()), &pStmt);
+            if (rc == SQLITE_OK && sqlite3_step(pStmt) == SQLITE_ROW) {
+                last = std::max(last, sqlite3_column_int64(pStmt, 0));
+            }
+            int rc2 = sqlite3_finalize(pStmt);
+            if (rc != SQLITE_OK || rc2 != SQLITE_OK) {
+                return rc != SQLITE_OK ? rc : rc2;
+            }
+        }
+        vtab->next_rowid = last + 1;
+    }
+    *pRowid = vtab->next_rowid++;
+    return SQLITE_OK;
+}
+
+/**
+ * Special INSERT commands of FTS5, e.g. 'optimize' or 'merge', go to every shard
+ */
+static int shards_command(shards_vtab *vtab, sqlite3_value *pCommand, sqlite3_value *pArg) {
+    int rc = SQLITE_OK;
+    for (const auto &shard: vtab->shards) {
+        sqlite3_stmt *pStmt = nullptr;
+        rc = prepare_owned(vtab->db, sqlite3_mprintf("INSERT INTO \"%w\".\"%w\"(\"%w\", rank) VALUES(?, ?)",
+                                                     shard.schema.c_str(), vtab->table.c_str(), vtab->table.c_str()),
+                           &pStmt);
+        if (rc == SQLITE_OK) {
+            sqlite3_bind_value(pStmt, 1, pCommand);
+            sqlite3_bind_value(pStmt, 2, pArg);
+            sqlite3_step(pStmt);
+        }
+        int rc2 = sqlite3_finalize(pStmt);
+        if (rc == SQLITE_OK) {
+            rc = rc2;
+        }
+        if (rc != SQLITE_OK) {
+            break;
+        }
+    }
+    return rc;
+}
+
+static int shards_update(sqlite3_vtab *pVtab, int argc, sqlite3_value **argv, sqlite_int64 *pRowid) {
+    auto *vtab = (shards_vtab *) pVtab;
+    size_t nCol = vtab->columns.size();
+
+    int rc;
+    try {
+        if (argc == 1) {
+            rc = shard_delete(vtab, sqlite3_value_int64(argv[0]));
+        } else if (sqlite3_value_type(argv[0]) == SQLITE_NULL &&
+                   sqlite3_value_type(argv[2 + nCol]) != SQLITE_NULL) {
+            rc = shards_command(vtab, argv[2 + nCol], argv[3 + nCol]);
+        } else {
+            // An update may move the row to another shard, thus a delete then an insert as FTS5 does
+            rc = SQLITE_OK;
+            if (sqlite3_value_type(argv[0]) != SQLITE_NULL) {
+                rc = shard_delete(vtab, sqlite3_value_int64(argv[0]));
+            }
+            sqlite3_int64 rowid = 0;
+            if (rc == SQLITE_OK) {
+                if (sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+                    rc = shards_next_rowid(vtab, &rowid);
+                } else {
+                    rowid = sqlite3_value_int64(argv[1]);
+                    vtab->next_rowid = vtab->next_rowid != 0 ? std::max(vtab->next_rowid, rowid + 1) : 0;
+                }
+            }
+            if (rc == SQLITE_OK) {
+                rc = shard_insert(vtab, rowid, argv + 2);
+                *pRowid = rowid;
+            }
+        }
+    } catch (const std::bad_alloc &) {
+        return SQLITE_NOMEM;
+    }
+    if (rc != SQLITE_OK && rc != SQLITE_NOMEM) {
+        shards_error(pVtab, "%s", sqlite3_errmsg(vtab->db));
+    }
+    return rc;
+}
+
+// The next rowid is only known within a transaction
+static int shards_begin(sqlite3_vtab *pVtab) {
+    ((shards_vtab *) pVtab)->next_rowid = 0;
+    return SQLITE_OK;
+}
+
+// Fields are assigned by name, the struct grows with SQLite versions
+static sqlite3_module make_shards_module() {
+    sqlite3_module m{};
+    m.iVersion = 0;
+    m.xCreate = shards_connect;     /* The shards are created by the application */
+    m.xConnect = shards_connect;
+    m.xBestIndex = shards_best_index;
+    m.xDisconnect = shards_disconnect;
+    m.xDestroy = shards_disconnect;
+    m.xOpen = shards_open;
+    m.xClose = shards_close;
+    m.xFilter = shards_filter;
+    m.xNext = shards_next;
+    m.xEof = shards_eof;
+    m.xColumn = shards_column;
+    m.xRowid = shards_rowid;
+    m.xUpdate = shards_update;
+    m.xBegin = shards_begin;
+    return m;
+}
+
+static const sqlite3_module shards_module = make_shards_module();
+
+int ngram_shards_register(sqlite3 *db, fts5_api *pFts5Api) {
+    int rc = shard_stats_register(pFts5Api);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    return sqlite3_create_module(db, LIBNAME "_shards", &shards_module, pFts5Api);
+}
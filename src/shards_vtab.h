@@ -0,0 +1,12 @@
+#pragma once
+
+#include "sqlite3ext.h"
+
+/*
+ * CREATE VIRTUAL TABLE t USING ngram_shards(fts_table, shard_schema, ...)
+ *  One table over the FTS5 table fts_table of every attached shard, rows go to a shard by the hash
+ *  of their rowid and MATCH runs on all shards at once, each on a thread with its own connection.
+ *  The rank is bm25() over the statistics summed over the shards, the same as of one table of the rows,
+ *  except that with AND, NOT or NEAR a shard without matches does not count the rows of the phrases.
+ */
+int ngram_shards_register(sqlite3 *db, fts5_api *pFts5Api);
@@ -0,0 +1,519 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <map>
+#include <queue>
+#include <set>
+#include <strings.h>
+#ifndef DROMOZOA_NO_GOOGLE_LOGGING
+#include <glog/logging.h>
+#else
+#include "common.hpp"
+#endif
+
+#include "phrase_lookup.h"
+#include "similar_vtab.h"
+#include "tokenizer.h"
+#include "utils.h"
+
+SQLITE_EXTENSION_INIT3
+
+// see:
+//  https://sqlite.org/fts5.html#full_text_query_syntax
+//  Approximate string matching with q-grams, the T-occurrence problem:
+//  C. Li, J. Lu, Y. Lu, "Efficient Merging and Filtering Algorithms for Approximate String Searches", ICDE 2008
+
+#define SIMILAR_COLUMN_DOC          0
+#define SIMILAR_COLUMN_COL          1
+#define SIMILAR_COLUMN_VALUE        2
+#define SIMILAR_COLUMN_SHARED       3
+#define SIMILAR_COLUMN_SCORE        4
+#define SIMILAR_COLUMN_FTS_TABLE    5
+#define SIMILAR_COLUMN_QUERY        6
+#define SIMILAR_COLUMN_THRESHOLD    7
+#define SIMILAR_COLUMN_MEASURE      8
+#define SIMILAR_ARGS                4
+
+#define DEFAULT_THRESHOLD   0.5
+
+// Slack for the floating point threshold, 0.5 * 4 should require exactly 2 shared grams
+#define THRESHOLD_EPSILON   1e-9
+
+typedef std::set<
+        ngram_tokenizer::String,
+        std::less<ngram_tokenizer::String>,
+        ngram_tokenizer::Allocator<ngram_tokenizer::String>
+> gram_set_t;
+
+// Grams of the query, each with the text of its first window
+typedef std::map<
+        ngram_tokenizer::String,
+        ngram_tokenizer::String,
+        std::less<ngram_tokenizer::String>,
+        ngram_tokenizer::Allocator<std::pair<const ngram_tokenizer::String, ngram_tokenizer::String>>
+> gram_map_t;
+
+typedef struct {
+    const char *pText;
+    gram_map_t grams;
+} query_grams_t;
+
+typedef enum {
+    MEASURE_DICE,
+    MEASURE_JACCARD,
+} measure_t;
+
+// A column value of a row, the unit of matching
+typedef ngram_posting_t posting_t;
+
+typedef struct {
+    posting_t posting;
+    ngram_tokenizer::String value;
+    int shared;
+    double score;
+} similar_row_t;
+
+typedef struct {
+    sqlite3_vtab base;
+    sqlite3 *db;
+    fts5_api *pFts5Api;
+} similar_vtab;
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    ngram_tokenizer::Vector<similar_row_t> rows;
+    ngram_fts_table_t table;
+    size_t i;
+} similar_cursor;
+
+static void similar_error(sqlite3_vtab *pVtab, const char *zFormat, const char *zArg) {
+    sqlite3_free(pVtab->zErrMsg);
+    pVtab->zErrMsg = sqlite3_mprintf(zFormat, zArg);
+}
+
+static int similar_connect(
+        sqlite3 *db,
+        void *pAux,
+        int argc,
+        const char *const *argv,
+        sqlite3_vtab **ppVtab,
+        char **pzErr) {
+    UNUSED(argc);
+    UNUSED(argv, pzErr);
+
+    int rc = sqlite3_declare_vtab(
+            db, "CREATE TABLE x(doc, col, value, shared, score, "
+                "fts_table HIDDEN, query HIDDEN, threshold HIDDEN, measure HIDDEN)");
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+
+    void *mem = sqlite3_malloc(sizeof(similar_vtab));
+    if (mem == nullptr) {
+        return SQLITE_NOMEM;
+    }
+    auto *vtab = new(mem) similar_vtab();
+    vtab->db = db;
+    vtab->pFts5Api = (fts5_api *) pAux;
+
+    *ppVtab = &vtab->base;
+    return SQLITE_OK;
+}
+
+static int similar_disconnect(sqlite3_vtab *pVtab) {
+    auto *vtab = (similar_vtab *) pVtab;
+    vtab->~similar_vtab();
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+static int similar_best_index(sqlite3_vtab *pVtab, sqlite3_index_info *pInfo) {
+    UNUSED(pVtab);
+
+    // Bit i of idxNum tells the i-th argument is given, they are passed to xFilter() in column order
+    int aIdx[SIMILAR_ARGS] = {-1, -1, -1, -1};
+    for (int i = 0; i < pInfo->nConstraint; i++) {
+        const auto &c = pInfo->aConstraint[i];
+        if (c.op != SQLITE_INDEX_CONSTRAINT_EQ || c.iColumn < SIMILAR_COLUMN_FTS_TABLE) {
+            continue;
+        }
+        if (!c.usable) {
+            return SQLITE_CONSTRAINT;
+        }
+        aIdx[c.iColumn - SIMILAR_COLUMN_FTS_TABLE] = i;
+    }
+
+    int argvIndex = 0;
+    pInfo->idxNum = 0;
+    for (int i = 0; i < SIMILAR_ARGS; i++) {
+        if (aIdx[i] >= 0) {
+            pInfo->idxNum |= 1 << i;
+            pInfo->aConstraintUsage[aIdx[i]].argvIndex = ++argvIndex;
+            pInfo->aConstraintUsage[aIdx[i]].omit = 1;
+        }
+    }
+
+    // Rows come out in descending score order
+    if (pInfo->nOrderBy == 1 && pInfo->aOrderBy[0].iColumn == SIMILAR_COLUMN_SCORE && pInfo->aOrderBy[0].desc) {
+        pInfo->orderByConsumed = 1;
+    }
+    pInfo->estimatedCost = 1e4;
+    pInfo->estimatedRows = 10;
+    return SQLITE_OK;
+}
+
+static int similar_open(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor) {
+    UNUSED(pVtab);
+
+    void *mem = sqlite3_malloc(sizeof(similar_cursor));
+    if (mem == nullptr) {
+        return SQLITE_NOMEM;
+    }
+    auto *cur = new(mem) similar_cursor{};
+
+    *ppCursor = &cur->base;
+    return SQLITE_OK;
+}
+
+static int similar_close(sqlite3_vtab_cursor *pCursor) {
+    auto *cur = (similar_cursor *) pCursor;
+    cur->~similar_cursor();
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+static int gram_collect_cb(void *pCtx, int tflags, const char *pToken, int nToken, int iStart, int iEnd) {
+    UNUSED(tflags);
+    UNUSED(iStart, iEnd);
+
+    ((gram_set_t *) pCtx)->emplace(pToken, nToken);
+    return SQLITE_OK;
+}
+
+static int query_collect_cb(void *pCtx, int tflags, const char *pToken, int nToken, int iStart, int iEnd) {
+    UNUSED(tflags);
+
+    auto *query = (query_grams_t *) pCtx;
+    // Delegate tokenizers call back from C frames, nothing may unwind through them
+    try {
+        query->grams.emplace(ngram_tokenizer::String(pToken, nToken),
+                             ngram_tokenizer::String(query->pText + iStart, iEnd - iStart));
+    } catch (const std::bad_alloc &) {
+        return SQLITE_NOMEM;
+    }
+    return SQLITE_OK;
+}
+
+// Characters of a window, the ones shorter than a gram end a run of CJK characters
+static bool is_short_window(const ngram_tokenizer::String &window, int ngram) {
+    size_t n = 0;
+    bool cjk = false;
+    for (char c: window) {
+        n += ((unsigned char) c & 0xC0) != 0x80;
+        cjk = cjk || (unsigned char) c >= 0x80;
+    }
+    return cjk && n < (size_t) ngram;
+}
+
+/**
+ * Minimum number of grams a value must share with the query to reach the threshold
+ *  The size of the value is unknown at this point, so the bound only assumes it shares c grams.
+ */
+static int min_shared_grams(measure_t measure, double threshold, size_t nQuery) {
+    double t;
+    if (measure == MEASURE_JACCARD) {
+        // c / (|Q| + |D| - c) >= t, and |Q| + |D| - c >= |Q|
+        t = threshold * (double) nQuery;
+    } else {
+        // 2c / (|Q| + |D|) >= t, and |D| >= c
+        t = threshold * (double) nQuery / (2 - threshold);
+    }
+    return std::max(1, (int) std::ceil(t - THRESHOLD_EPSILON));
+}
+
+static double similarity(measure_t measure, size_t nShared, size_t nQuery, size_t nValue) {
+    if (measure == MEASURE_JACCARD) {
+        return (double) nShared / (double) (nQuery + nValue - nShared);
+    }
+    return 2.0 * (double) nShared / (double) (nQuery + nValue);
+}
+
+/**
+ * Count-merge the sorted posting lists, keeping the column values found in at least min_shared lists
+ */
+static void merge_postings(const ngram_tokenizer::Vector<ngram_tokenizer::Vector<posting_t>> &lists, int min_shared,
+                           ngram_tokenizer::Vector<similar_row_t> &candidates) {
+    typedef std::pair<posting_t, size_t> head_t;
+    auto greater = [](const head_t &a, const head_t &b) { return b.first < a.first; };
+    std::priority_queue<head_t, ngram_tokenizer::Vector<head_t>, decltype(greater)> heads(greater);
+    ngram_tokenizer::Vector<size_t> cursors(lists.size(), 0);
+    for (size_t i = 0; i < lists.size(); i++) {
+        if (!lists[i].empty()) {
+            heads.emplace(lists[i][0], i);
+        }
+    }
+
+    while (!heads.empty()) {
+        posting_t posting = heads.top().first;
+        int count = 0;
+        while (!heads.empty() && heads.top().first == posting) {
+            size_t i = heads.top().second;
+            heads.pop();
+            count++;
+            if (++cursors[i] < lists[i].size()) {
+                heads.emplace(lists[i][cursors[i]], i);
+            }
+        }
+        if (count >= min_shared) {
+            similar_row_t row{};
+            row.posting = posting;
+            row.shared = count;
+            candidates.push_back(std::move(row));
+        }
+    }
+}
+
+/**
+ * Fetch every candidate value and compute its exact similarity, dropping the ones under the threshold
+ */
+static int similar_verify(similar_vtab *vtab, similar_cursor *cur, Fts5Tokenizer *pTok,
+                          const gram_map_t &query, measure_t measure, double threshold,
+                          ngram_tokenizer::Vector<similar_row_t> &candidates) {
+    ngram_tokenizer::Vector<sqlite3_stmt *> stmts(cur->table.columns.size(), nullptr);
+    int rc = SQLITE_OK;
+    for (auto &row: candidates) {
+        int col = row.posting.col;
+        if (col < 0 || col >= (int) stmts.size()) {
+            continue;
+        }
+        if (stmts[col] == nullptr) {
+            char *zSql = sqlite3_mprintf("SELECT \"%w\" FROM \"%w\".\"%w\" WHERE rowid = ?",
+                                         cur->table.columns[col].c_str(), cur->table.schema.c_str(),
+                                         cur->table.name.c_str());
+            if (zSql == nullptr) {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            rc = sqlite3_prepare_v2(vtab->db, zSql, -1, &stmts[col], nullptr);
+            sqlite3_free(zSql);
+            if (rc != SQLITE_OK) {
+                break;
+            }
+        }
+
+        sqlite3_stmt *pStmt = stmts[col];
+        sqlite3_bind_int64(pStmt, 1, row.posting.doc);
+        if (sqlite3_step(pStmt) == SQLITE_ROW && sqlite3_column_type(pStmt, 0) != SQLITE_NULL) {
+            auto p = (const char *) sqlite3_column_text(pStmt, 0);
+            int n = sqlite3_column_bytes(pStmt, 0);
+            gram_set_t value;
+            rc = ngram_cb_tokenize(pTok, &value, FTS5_TOKENIZE_DOCUMENT, p, n, gram_collect_cb);
+            if (rc == SQLITE_OK) {
+                size_t nShared = 0;
+                for (const auto &gram: value) {
+                    nShared += query.count(gram);
+                }
+                row.shared = (int) nShared;
+                row.score = similarity(measure, nShared, query.size(), value.size());
+                if (row.score + THRESHOLD_EPSILON >= threshold) {
+                    row.value.assign(p, n);
+                    cur->rows.push_back(std::move(row));
+                }
+            }
+        }
+        // Contentless tables have no value to verify against, such candidates are dropped
+        sqlite3_reset(pStmt);
+        if (rc != SQLITE_OK) {
+            break;
+        }
+    }
+    for (auto pStmt: stmts) {
+        sqlite3_finalize(pStmt);
+    }
+    return rc;
+}
+
+static int similar_search(similar_vtab *vtab, similar_cursor *cur, const char *zTable, const char *zQuery,
+                          double threshold, measure_t measure) {
+    char *zErr = nullptr;
+    int rc = ngram_fts_table_find(vtab->db, zTable, cur->table, &zErr);
+    if (rc != SQLITE_OK) {
+        similar_error(&vtab->base, "%s", zErr != nullptr ? zErr : sqlite3_errmsg(vtab->db));
+        sqlite3_free(zErr);
+        return rc;
+    }
+    const auto &options = cur->table.options;
+
+    Fts5Tokenizer *pTok = nullptr;
+    rc = ngram_cb_create_options(vtab->pFts5Api, options.c_str(), &pTok);
+    if (rc != SQLITE_OK) {
+        similar_error(&vtab->base, "invalid " LIBNAME " tokenizer options: %s", options.c_str());
+        return rc;
+    }
+    // Release the tokenizer however the search ends
+    std::unique_ptr<Fts5Tokenizer, void (*)(Fts5Tokenizer *)> guard(pTok, ngram_cb_delete);
+    int ngram = ((ngram_context_t *) pTok)->options.ngram;
+
+    query_grams_t query{zQuery, gram_map_t()};
+    // Tokenized as the values are, a query drops the short windows at the end of a run
+    rc = ngram_cb_tokenize(pTok, &query, FTS5_TOKENIZE_DOCUMENT, zQuery, (int) strlen(zQuery), query_collect_cb);
+    if (rc != SQLITE_OK || query.grams.empty()) {
+        return rc;
+    }
+
+    // The rows of a gram are those matching its window as a phrase, a short window as a prefix query
+    //  that matches more rows than the gram. The candidates are verified anyway.
+    sqlite3_stmt *pStmt = nullptr;
+    rc = ngram_phrase_prepare(vtab->db, cur->table, true, &pStmt);
+    if (rc != SQLITE_OK) {
+        similar_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+        return rc;
+    }
+    ngram_tokenizer::Vector<ngram_tokenizer::Vector<posting_t>> lists(query.grams.size());
+    size_t i = 0;
+    for (const auto &gram: query.grams) {
+        ngram_tokenizer::String match;
+        ngram_append_phrase(gram.second, is_short_window(gram.second, ngram), match);
+        rc = ngram_phrase_postings(pStmt, match, lists[i++]);
+        if (rc != SQLITE_OK) {
+            break;
+        }
+    }
+    sqlite3_finalize(pStmt);
+    if (rc != SQLITE_OK) {
+        similar_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+        return rc;
+    }
+
+    int min_shared = min_shared_grams(measure, threshold, query.grams.size());
+    DLOG(INFO) << "query grams: " << query.grams.size() << " min_shared: " << min_shared;
+    ngram_tokenizer::Vector<similar_row_t> candidates;
+    merge_postings(lists, min_shared, candidates);
+
+    rc = similar_verify(vtab, cur, pTok, query.grams, measure, threshold, candidates);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    std::stable_sort(cur->rows.begin(), cur->rows.end(), [](const similar_row_t &a, const similar_row_t &b) {
+        return a.score > b.score;
+    });
+    return SQLITE_OK;
+}
+
+static int similar_filter(
+        sqlite3_vtab_cursor *pCursor,
+        int idxNum,
+        const char *idxStr,
+        int argc,
+        sqlite3_value **argv) {
+    UNUSED(idxStr, argc);
+
+    auto *cur = (similar_cursor *) pCursor;
+    auto *vtab = (similar_vtab *) pCursor->pVtab;
+    cur->rows.clear();
+    cur->table.columns.clear();
+    cur->i = 0;
+
+    sqlite3_value *apArg[SIMILAR_ARGS] = {};
+    for (int i = 0, j = 0; i < SIMILAR_ARGS; i++) {
+        if (idxNum & (1 << i)) {
+            apArg[i] = argv[j++];
+        }
+    }
+    auto zTable = (const char *) (apArg[0] ? sqlite3_value_text(apArg[0]) : nullptr);
+    auto zQuery = (const char *) (apArg[1] ? sqlite3_value_text(apArg[1]) : nullptr);
+    double threshold = apArg[2] ? sqlite3_value_double(apArg[2]) : DEFAULT_THRESHOLD;
+    auto zMeasure = (const char *) (apArg[3] ? sqlite3_value_text(apArg[3]) : nullptr);
+    if (zTable == nullptr || zQuery == nullptr) {
+        similar_error(&vtab->base, "%s", LIBNAME "_similar() expected an FTS5 table and a query");
+        return SQLITE_ERROR;
+    }
+    if (threshold <= 0 || threshold > 1) {
+        similar_error(&vtab->base, "%s", "threshold should be in range (0, 1]");
+        return SQLITE_ERROR;
+    }
+    measure_t measure = MEASURE_DICE;
+    if (zMeasure != nullptr && !strcasecmp(zMeasure, "jaccard")) {
+        measure = MEASURE_JACCARD;
+    } else if (zMeasure != nullptr && strcasecmp(zMeasure, "dice")) {
+        similar_error(&vtab->base, "unknown similarity measure: %s", zMeasure);
+        return SQLITE_ERROR;
+    }
+
+    try {
+        return similar_search(vtab, cur, zTable, zQuery, threshold, measure);
+    } catch (const std::bad_alloc &) {
+        return SQLITE_NOMEM;
+    }
+}
+
+static int similar_next(sqlite3_vtab_cursor *pCursor) {
+    ((similar_cursor *) pCursor)->i++;
+    return SQLITE_OK;
+}
+
+static int similar_eof(sqlite3_vtab_cursor *pCursor) {
+    auto *cur = (similar_cursor *) pCursor;
+    return cur->i >= cur->rows.size();
+}
+
+static int similar_column(sqlite3_vtab_cursor *pCursor, sqlite3_context *pCtx, int i) {
+    auto *cur = (similar_cursor *) pCursor;
+    const auto &row = cur->rows[cur->i];
+    switch (i) {
+        case SIMILAR_COLUMN_DOC:
+            sqlite3_result_int64(pCtx, row.posting.doc);
+            break;
+        case SIMILAR_COLUMN_COL: {
+            const auto &col = cur->table.columns[row.posting.col];
+            sqlite3_result_text(pCtx, col.data(), (int) col.size(), SQLITE_TRANSIENT);
+            break;
+        }
+        case SIMILAR_COLUMN_VALUE:
+            sqlite3_result_text(pCtx, row.value.data(), (int) row.value.size(), SQLITE_TRANSIENT);
+            break;
+        case SIMILAR_COLUMN_SHARED:
+            sqlite3_result_int(pCtx, row.shared);
+            break;
+        case SIMILAR_COLUMN_SCORE:
+            sqlite3_result_double(pCtx, row.score);
+            break;
+        default:
+            // Hidden columns are consumed by xFilter()
+            sqlite3_result_null(pCtx);
+            break;
+    }
+    return SQLITE_OK;
+}
+
+static int similar_rowid(sqlite3_vtab_cursor *pCursor, sqlite_int64 *pRowid) {
+    *pRowid = (sqlite_int64) ((similar_cursor *) pCursor)->i + 1;
+    return SQLITE_OK;
+}
+
+// Fields are assigned by name, the struct grows with SQLite versions
+static sqlite3_module make_similar_module() {
+    sqlite3_module m{};
+    m.iVersion = 0;
+    m.xCreate = nullptr;        /* Eponymous-only */
+    m.xConnect = similar_connect;
+    m.xBestIndex = similar_best_index;
+    m.xDisconnect = similar_disconnect;
+    m.xOpen = similar_open;
+    m.xClose = similar_close;
+    m.xFilter = similar_filter;
+    m.xNext = similar_next;
+    m.xEof = similar_eof;
+    m.xColumn = similar_column;
+    m.xRowid = similar_rowid;
+    return m;
+}
+
+static const sqlite3_module similar_module = make_similar_module();
+
+int ngram_similar_register(sqlite3 *db, fts5_api *pFts5Api) {
+    return sqlite3_create_module(db, LIBNAME "_similar", &similar_module, pFts5Api);
+}
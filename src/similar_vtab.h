@@ -0,0 +1,9 @@
+#pragma once
+
+#include "sqlite3ext.h"
+
+/*
+ * ngram_similar(fts_table, query, threshold, measure)
+ *  Eponymous table-valued function finding column values sharing enough grams with the query.
+ */
+int ngram_similar_register(sqlite3 *db, fts5_api *pFts5Api);
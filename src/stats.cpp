@@ -0,0 +1,34 @@
+#include "stats.h"
+
+#include <atomic>
+#include <cstring>
+
+namespace ngram_tokenizer {
+    static const char *const STAT_NAMES[STAT_COUNT] = {
+            "scratch_bytes",
+            "query_cache_hits",
+            "query_cache_misses",
+            "offsets_hits",
+            "offsets_misses",
+    };
+
+    static std::atomic<int64_t> stats[STAT_COUNT];
+
+    void stat_add(stat_t stat, int64_t n) {
+        stats[stat].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    int64_t stat_get(stat_t stat) {
+        return stats[stat].load(std::memory_order_relaxed);
+    }
+
+    bool stat_lookup(const char *name, stat_t *stat) {
+        for (int i = 0; i < STAT_COUNT; i++) {
+            if (!strcmp(name, STAT_NAMES[i])) {
+                *stat = (stat_t) i;
+                return true;
+            }
+        }
+        return false;
+    }
+}
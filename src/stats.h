@@ -0,0 +1,26 @@
+/**
+ * Process-wide counters of the extension, exposed to SQL by ngram_stat()
+ *
+ * see: LICENSE.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace ngram_tokenizer {
+    typedef enum {
+        STAT_SCRATCH_BYTES,     /* Bytes held by the scratch buffers of all tokenizers */
+        STAT_QUERY_CACHE_HITS,  /* Queries replayed from the query cache */
+        STAT_QUERY_CACHE_MISSES,
+        STAT_OFFSETS_HITS,      /* Positions read from the offsets sidecar rather than tokenized again */
+        STAT_OFFSETS_MISSES,
+        STAT_COUNT
+    } stat_t;
+
+    void stat_add(stat_t, int64_t);
+
+    int64_t stat_get(stat_t);
+
+    bool stat_lookup(const char *, stat_t *);
+}
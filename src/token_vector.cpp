@@ -7,24 +7,18 @@
 #include "common.hpp"
 #endif
 #include <iostream>
-#include <utility>
 
 namespace ngram_tokenizer {
-    Token::Token(std::string str, int iStart, int iEnd, token_category_t category) {
+    Token::Token(int iStart, int iEnd, token_category_t category) {
         CHECK_GE(iStart, 0);
         CHECK_GE(iEnd, 0);
         CHECK_LT(iStart, iEnd);
 
-        this->str = std::move(str);
         this->iStart = iStart;
         this->iEnd = iEnd;
         this->category = category;
     }
 
-    const std::string &Token::get_str() const {
-        return str;
-    }
-
     int Token::get_iStart() const {
         return iStart;
     }
@@ -37,7 +31,7 @@ namespace ngram_tokenizer {
         return category;
     }
 
-    TokenVector::TokenVector(const char *pText, int nText) {
+    TokenVector::TokenVector(const char *pText, int nText, Vector<Token> &tokens) : tokens(tokens) {
         CHECK_NOTNULL(pText);
         CHECK_GE(nText, 0);
         this->pText = pText;
@@ -46,6 +40,8 @@ namespace ngram_tokenizer {
     }
 
     bool TokenVector::tokenize() {
+        tokens.clear();
+
         int iStart = 0;
         int iEnd = 0;
 
@@ -65,9 +61,7 @@ namespace ngram_tokenizer {
             }
 
             if (category != SPACE_OR_CONTROL) {
-                // Will properly null-terminate the resulting std::string
-                std::string s(pText + iStart, iEnd - iStart);
-                tokens.emplace_back(s, iStart, iEnd, category);
+                tokens.emplace_back(iStart, iEnd, category);
             }
 
             iStart = iEnd;
@@ -82,7 +76,7 @@ namespace ngram_tokenizer {
     }
 
     // Call only after a successful call of tokenize()
-    const std::vector<Token> &TokenVector::get_tokens() const {
+    const Vector<Token> &TokenVector::get_tokens() const {
         CHECK(ok);
         return tokens;
     }
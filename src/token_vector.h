@@ -1,7 +1,6 @@
 #pragma once
 
-#include <string>
-#include <vector>
+#include "allocator.h"
 
 namespace ngram_tokenizer {
     typedef enum {
@@ -12,11 +11,10 @@ namespace ngram_tokenizer {
         OTHER
     } token_category_t;
 
+    // Byte range of a token within the input text, the text itself is never copied
     class Token {
     public:
-        Token(std::string, int, int, token_category_t);
-
-        const std::string &get_str() const;
+        Token(int, int, token_category_t);
 
         int get_iStart() const;
 
@@ -25,7 +23,6 @@ namespace ngram_tokenizer {
         token_category_t get_category() const;
 
     private:
-        std::string str;
         int iStart; // Inclusive
         int iEnd; // Exclusive
         token_category_t category;
@@ -33,11 +30,12 @@ namespace ngram_tokenizer {
 
     class TokenVector {
     public:
-        TokenVector(const char *, int);
+        // The tokens are stored into the given vector, so its capacity can be reused across texts
+        TokenVector(const char *, int, Vector<Token> &);
 
         bool tokenize();
 
-        const std::vector<Token> &get_tokens() const;
+        const Vector<Token> &get_tokens() const;
 
     private:
         static token_category_t token_category(char);
@@ -46,7 +44,7 @@ namespace ngram_tokenizer {
 
         const char *pText;
         int nText;
-        std::vector<Token> tokens;
+        Vector<Token> &tokens;
         bool ok;
     };
 }
@@ -0,0 +1,57 @@
+/**
+ * The ngram tokenizer instance, shared by the FTS5 callbacks and the table-valued functions
+ *
+ * see: LICENSE.
+ */
+
+#pragma once
+
+#include "sqlite3ext.h"
+
+#include "gram_engine.h"
+#include "scratch.h"
+#include "query_cache.h"
+
+// see:
+//  7.1. Custom Tokenizers
+//  https://sqlite.org/fts5.html#custom_tokenizers
+
+#define DEFAULT_QUERY_CACHE     64      /* Entries */
+#define MAX_QUERY_CACHE         65536
+
+typedef int (*xTokenCallback)(
+        void *pCtx,         /* Copy of 2nd argument to xTokenize() */
+        int tflags,         /* Mask of FTS5_TOKEN_* flags */
+        const char *pToken, /* Pointer to buffer containing token */
+        int nToken,         /* Size of token in bytes */
+        int iStart,         /* Byte offset of token within input text */
+        int iEnd            /* Byte offset of end of token within input text */
+);
+
+typedef struct {
+    ngram_tokenizer::GramOptions options;
+    ngram_tokenizer::gram_engine_t engine;      /* Instantiation of options.ngram */
+    fts5_tokenizer delegate;        /* Tokenizer for non-CJK runs, if any */
+    Fts5Tokenizer *pDelegate;
+    ngram_tokenizer::Scratch scratch;
+    ngram_tokenizer::QueryCache query_cache;
+} ngram_context_t;
+
+int ngram_cb_create(void *pCtx, const char **azArg, int nArg, Fts5Tokenizer **ppOut);
+
+void ngram_cb_delete(Fts5Tokenizer *pTok);
+
+int ngram_cb_tokenize(Fts5Tokenizer *pTok, void *pCtx, int flags, const char *pText, int nText, xTokenCallback xToken);
+
+int ngram_cb_tokenize_locale(Fts5Tokenizer *pTok, void *pCtx, int flags, const char *pText, int nText,
+                             const char *pLocale, int nLocale, xTokenCallback xToken);
+
+int ngram_cb_create_options(fts5_api *pFts5Api, const char *zOptions, Fts5Tokenizer **ppOut);
+
+bool ngram_parse_fts5_option(const char *zSql, const char *zName, ngram_tokenizer::String &value);
+
+bool ngram_parse_tokenize_option(const char *zSql, ngram_tokenizer::String &options);
+
+int ngram_open_worker(const char *zFilename, int flags, sqlite3 **ppDb);
+
+fts5_api *ngram_fts5_api(sqlite3 *db);
@@ -0,0 +1,366 @@
+#include <cstring>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <new>
+#ifndef DROMOZOA_NO_GOOGLE_LOGGING
+#include <glog/logging.h>
+#else
+#include "common.hpp"
+#endif
+
+#include "tokens_vtab.h"
+#include "tokenizer.h"
+#include "gram_iterator.h"
+#include "utils.h"
+
+SQLITE_EXTENSION_INIT3
+
+// see:
+//  https://sqlite.org/vtab.html#eponymous_only_virtual_tables
+//  https://github.com/sqlite/sqlite/blob/master/ext/misc/series.c
+
+#define TOKENS_COLUMN_TOKEN         0
+#define TOKENS_COLUMN_ISTART        1
+#define TOKENS_COLUMN_IEND          2
+#define TOKENS_COLUMN_POSITION      3
+#define TOKENS_COLUMN_COLOCATED     4
+#define TOKENS_COLUMN_INPUT         5
+#define TOKENS_COLUMN_OPTIONS       6
+
+#define TOKENS_IDX_INPUT            1
+#define TOKENS_IDX_OPTIONS          2
+
+// Tokenizers kept per distinct options string
+#define MAX_CACHED_CONFIGS          16
+
+// Options strings, most recently used first
+typedef std::list<ngram_tokenizer::String, ngram_tokenizer::Allocator<ngram_tokenizer::String>> config_lru_t;
+
+typedef struct {
+    Fts5Tokenizer *pTok;
+    config_lru_t::iterator lru;
+} config_slot_t;
+
+typedef std::map<
+        ngram_tokenizer::String,
+        config_slot_t,
+        std::less<ngram_tokenizer::String>,
+        ngram_tokenizer::Allocator<std::pair<const ngram_tokenizer::String, config_slot_t>>
+> config_cache_t;
+
+typedef struct {
+    sqlite3_vtab base;
+    fts5_api *pFts5Api;
+    config_cache_t configs;
+    config_lru_t lru;
+} tokens_vtab;
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    ngram_tokenizer::GramOptions options;   /* Copy, the cached tokenizer may be evicted by another cursor */
+    ngram_tokenizer::String text;       /* Copy of the input, sqlite3_value is only valid in xFilter() */
+    ngram_tokenizer::Scratch scratch;
+    ngram_tokenizer::GramIterator it;
+    sqlite3_int64 rowid;
+    bool eof;
+    const char *pGram;
+    int nGram;
+    int iStart;
+    int iEnd;
+} tokens_cursor;
+
+static void tokens_error(sqlite3_vtab *pVtab, const char *zMsg) {
+    sqlite3_free(pVtab->zErrMsg);
+    pVtab->zErrMsg = sqlite3_mprintf("%s", zMsg);
+}
+
+static int tokens_connect(
+        sqlite3 *db,
+        void *pAux,
+        int argc,
+        const char *const *argv,
+        sqlite3_vtab **ppVtab,
+        char **pzErr) {
+    UNUSED(argc);
+    UNUSED(argv, pzErr);
+
+    int rc = sqlite3_declare_vtab(
+            db, "CREATE TABLE x(token, iStart, iEnd, position, colocated, input HIDDEN, options HIDDEN)");
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+
+    void *mem = sqlite3_malloc(sizeof(tokens_vtab));
+    if (mem == nullptr) {
+        return SQLITE_NOMEM;
+    }
+    auto *vtab = new(mem) tokens_vtab();
+    vtab->pFts5Api = (fts5_api *) pAux;
+    sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+
+    *ppVtab = &vtab->base;
+    return SQLITE_OK;
+}
+
+static int tokens_disconnect(sqlite3_vtab *pVtab) {
+    auto *vtab = (tokens_vtab *) pVtab;
+    for (auto &e: vtab->configs) {
+        ngram_cb_delete(e.second.pTok);
+    }
+    vtab->~tokens_vtab();
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+static int tokens_best_index(sqlite3_vtab *pVtab, sqlite3_index_info *pInfo) {
+    UNUSED(pVtab);
+
+    int iInput = -1;
+    int iOptions = -1;
+    for (int i = 0; i < pInfo->nConstraint; i++) {
+        const auto &c = pInfo->aConstraint[i];
+        if (c.op != SQLITE_INDEX_CONSTRAINT_EQ) {
+            continue;
+        }
+        if (c.iColumn == TOKENS_COLUMN_INPUT || c.iColumn == TOKENS_COLUMN_OPTIONS) {
+            // Hidden columns are the arguments, an unusable one means a join order that cannot work
+            if (!c.usable) {
+                return SQLITE_CONSTRAINT;
+            }
+            if (c.iColumn == TOKENS_COLUMN_INPUT) {
+                iInput = i;
+            } else {
+                iOptions = i;
+            }
+        }
+    }
+
+    int argvIndex = 0;
+    pInfo->idxNum = 0;
+    if (iInput >= 0) {
+        pInfo->idxNum |= TOKENS_IDX_INPUT;
+        pInfo->aConstraintUsage[iInput].argvIndex = ++argvIndex;
+        pInfo->aConstraintUsage[iInput].omit = 1;
+    }
+    if (iOptions >= 0) {
+        pInfo->idxNum |= TOKENS_IDX_OPTIONS;
+        pInfo->aConstraintUsage[iOptions].argvIndex = ++argvIndex;
+        pInfo->aConstraintUsage[iOptions].omit = 1;
+    }
+
+    // Rows come out in position order
+    if (pInfo->nOrderBy == 1 && pInfo->aOrderBy[0].iColumn == TOKENS_COLUMN_POSITION && !pInfo->aOrderBy[0].desc) {
+        pInfo->orderByConsumed = 1;
+    }
+    pInfo->estimatedCost = iInput >= 0 ? 10 : 1e9;
+    pInfo->estimatedRows = iInput >= 0 ? 100 : 1;
+    return SQLITE_OK;
+}
+
+static int tokens_open(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor) {
+    UNUSED(pVtab);
+
+    void *mem = sqlite3_malloc(sizeof(tokens_cursor));
+    if (mem == nullptr) {
+        return SQLITE_NOMEM;
+    }
+    auto *cur = new(mem) tokens_cursor{};
+    cur->eof = true;
+
+    *ppCursor = &cur->base;
+    return SQLITE_OK;
+}
+
+static int tokens_close(sqlite3_vtab_cursor *pCursor) {
+    auto *cur = (tokens_cursor *) pCursor;
+    cur->~tokens_cursor();
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+/**
+ * Look up the tokenizer of the options string, create and cache it on the first use
+ *  The least recently used tokenizer is evicted when the cache is full, as in QueryCache.
+ */
+static int tokens_config(tokens_vtab *vtab, const char *zOptions, ngram_context_t **pCtx) {
+    ngram_tokenizer::String key(zOptions);
+    auto found = vtab->configs.find(key);
+    if (found != vtab->configs.end()) {
+        vtab->lru.splice(vtab->lru.begin(), vtab->lru, found->second.lru);
+        *pCtx = (ngram_context_t *) found->second.pTok;
+        return SQLITE_OK;
+    }
+
+    // Same arguments as in CREATE VIRTUAL TABLE ... tokenize = 'ngram ...'
+    Fts5Tokenizer *pTok = nullptr;
+    int rc = ngram_cb_create_options(vtab->pFts5Api, zOptions, &pTok);
+    if (rc != SQLITE_OK) {
+        tokens_error(&vtab->base, "invalid " LIBNAME " tokenizer options");
+        return rc;
+    }
+    auto *ctx = (ngram_context_t *) pTok;
+    if (ctx->pDelegate != nullptr) {
+        ngram_cb_delete(pTok);
+        tokens_error(&vtab->base, "delegate is not supported by " LIBNAME "_tokens()");
+        return SQLITE_ERROR;
+    }
+
+    // Owned by the guard until the cache holds it
+    std::unique_ptr<Fts5Tokenizer, void (*)(Fts5Tokenizer *)> guard(pTok, ngram_cb_delete);
+    if (vtab->configs.size() >= MAX_CACHED_CONFIGS) {
+        auto victim = vtab->configs.find(vtab->lru.back());
+        ngram_cb_delete(victim->second.pTok);
+        vtab->configs.erase(victim);
+        vtab->lru.pop_back();
+    }
+    vtab->lru.push_front(key);
+    try {
+        vtab->configs.emplace(std::move(key), config_slot_t{pTok, vtab->lru.begin()});
+    } catch (const std::bad_alloc &) {
+        vtab->lru.pop_front();
+        throw;
+    }
+    guard.release();
+
+    *pCtx = ctx;
+    return SQLITE_OK;
+}
+
+static int tokens_next(sqlite3_vtab_cursor *pCursor) {
+    auto *cur = (tokens_cursor *) pCursor;
+
+    size_t first, last;
+    if (!cur->it.next(&first, &last)) {
+        cur->eof = true;
+        cur->scratch.end();
+        return SQLITE_OK;
+    }
+
+    const auto &tokens = cur->scratch.tokens;
+    ngram_tokenizer::build_gram(cur->text.data(), tokens, first, last,
+                                cur->options.case_sensitive, cur->options.compact_terms,
+                                cur->scratch, &cur->pGram, &cur->nGram);
+    cur->iStart = tokens[first].get_iStart();
+    cur->iEnd = tokens[last].get_iEnd();
+    cur->rowid++;
+    return SQLITE_OK;
+}
+
+static int tokens_filter(
+        sqlite3_vtab_cursor *pCursor,
+        int idxNum,
+        const char *idxStr,
+        int argc,
+        sqlite3_value **argv) {
+    UNUSED(idxStr, argc);
+
+    auto *cur = (tokens_cursor *) pCursor;
+    auto *vtab = (tokens_vtab *) pCursor->pVtab;
+    cur->eof = true;
+    cur->rowid = 0;
+
+    int i = 0;
+    const char *zInput = nullptr;
+    int nInput = 0;
+    if (idxNum & TOKENS_IDX_INPUT) {
+        zInput = (const char *) sqlite3_value_text(argv[i]);
+        nInput = sqlite3_value_bytes(argv[i]);
+        i++;
+    }
+    const char *zOptions = "";
+    if (idxNum & TOKENS_IDX_OPTIONS) {
+        zOptions = (const char *) sqlite3_value_text(argv[i]);
+        if (zOptions == nullptr) zOptions = "";
+    }
+    if (zInput == nullptr) {
+        return SQLITE_OK;
+    }
+
+    try {
+        ngram_context_t *ctx = nullptr;
+        int rc = tokens_config(vtab, zOptions, &ctx);
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+        cur->options = ctx->options;
+
+        if (ngram_tokenizer::utf8_validatestr(reinterpret_cast<const u_int8_t *>(zInput), nInput) != 0) {
+            tokens_error(&vtab->base, "invalid UTF-8 input");
+            return SQLITE_ERROR;
+        }
+
+        cur->text.assign(zInput, nInput);
+        cur->scratch.begin();
+        auto tv = ngram_tokenizer::TokenVector(cur->text.data(), (int) cur->text.size(), cur->scratch.tokens);
+        if (!tv.tokenize()) {
+            return SQLITE_ERROR;
+        }
+        cur->it = ngram_tokenizer::GramIterator(cur->scratch.tokens, cur->options.ngram);
+        cur->eof = false;
+        return tokens_next(pCursor);
+    } catch (const std::bad_alloc &) {
+        return SQLITE_NOMEM;
+    }
+}
+
+static int tokens_eof(sqlite3_vtab_cursor *pCursor) {
+    return ((tokens_cursor *) pCursor)->eof;
+}
+
+static int tokens_column(sqlite3_vtab_cursor *pCursor, sqlite3_context *pCtx, int i) {
+    auto *cur = (tokens_cursor *) pCursor;
+    switch (i) {
+        case TOKENS_COLUMN_TOKEN:
+            sqlite3_result_text(pCtx, cur->pGram, cur->nGram, SQLITE_TRANSIENT);
+            break;
+        case TOKENS_COLUMN_ISTART:
+            sqlite3_result_int(pCtx, cur->iStart);
+            break;
+        case TOKENS_COLUMN_IEND:
+            sqlite3_result_int(pCtx, cur->iEnd);
+            break;
+        case TOKENS_COLUMN_POSITION:
+            // Every token takes a new position, none is FTS5_TOKEN_COLOCATED
+            sqlite3_result_int64(pCtx, cur->rowid - 1);
+            break;
+        case TOKENS_COLUMN_COLOCATED:
+            sqlite3_result_int(pCtx, 0);
+            break;
+        default:
+            // Hidden columns are consumed by xFilter()
+            sqlite3_result_null(pCtx);
+            break;
+    }
+    return SQLITE_OK;
+}
+
+static int tokens_rowid(sqlite3_vtab_cursor *pCursor, sqlite_int64 *pRowid) {
+    *pRowid = ((tokens_cursor *) pCursor)->rowid;
+    return SQLITE_OK;
+}
+
+// Fields are assigned by name, the struct grows with SQLite versions
+static sqlite3_module make_tokens_module() {
+    sqlite3_module m{};
+    m.iVersion = 0;
+    m.xCreate = nullptr;        /* Eponymous-only */
+    m.xConnect = tokens_connect;
+    m.xBestIndex = tokens_best_index;
+    m.xDisconnect = tokens_disconnect;
+    m.xOpen = tokens_open;
+    m.xClose = tokens_close;
+    m.xFilter = tokens_filter;
+    m.xNext = tokens_next;
+    m.xEof = tokens_eof;
+    m.xColumn = tokens_column;
+    m.xRowid = tokens_rowid;
+    return m;
+}
+
+static const sqlite3_module tokens_module = make_tokens_module();
+
+int ngram_tokens_register(sqlite3 *db, fts5_api *pFts5Api) {
+    return sqlite3_create_module(db, LIBNAME "_tokens", &tokens_module, pFts5Api);
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "sqlite3ext.h"
+
+/*
+ * ngram_tokens(input, options)
+ *  Eponymous table-valued function streaming the tokens of input under the given tokenizer options.
+ */
+int ngram_tokens_register(sqlite3 *db, fts5_api *pFts5Api);
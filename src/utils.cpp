@@ -162,6 +162,45 @@ namespace ngram_tokenizer {
         return EINVAL;
     }
 
+    /**
+     * Decode the UTF-8 character at the start of a validated string
+     *
+     * @param len       where to store the byte count of the character
+     * @return          the code point
+     */
+    uint32_t utf8_decode(const char *str, size_t n, size_t *len) {
+        auto p = (const unsigned char *) str;
+        uint32_t c = p[0];
+        if (c < 0x80 || n < 2) {
+            *len = 1;
+            return c;
+        }
+        if (c < 0xE0) {
+            *len = 2;
+            return ((c & 0x1F) << 6) | (p[1] & 0x3F);
+        }
+        if (c < 0xF0 || n < 4) {
+            *len = 3;
+            return ((c & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+        }
+        *len = 4;
+        return ((c & 0x07) << 18) | ((p[1] & 0x3F) << 12) | ((p[2] & 0x3F) << 6) | (p[3] & 0x3F);
+    }
+
+    /**
+     * Whether a code point belongs to the CJK scripts(including Hangul, Kana and CJK punctuations)
+     *  which are written without white spaces between words.
+     */
+    bool is_cjk(uint32_t c) {
+        return (c >= 0x1100 && c <= 0x11FF)         /* Hangul Jamo */
+               || (c >= 0x2E80 && c <= 0x2FDF)      /* CJK Radicals, Kangxi Radicals */
+               || (c >= 0x3000 && c <= 0x9FFF)      /* CJK Symbols, Kana, Bopomofo, ..., CJK Unified Ideographs */
+               || (c >= 0xAC00 && c <= 0xD7AF)      /* Hangul Syllables */
+               || (c >= 0xF900 && c <= 0xFAFF)      /* CJK Compatibility Ideographs */
+               || (c >= 0xFF00 && c <= 0xFFEF)      /* Halfwidth and Fullwidth Forms */
+               || (c >= 0x20000 && c <= 0x3FFFF);   /* CJK Unified Ideographs Extension B - */
+    }
+
     // https://stackoverflow.com/questions/9435385/split-a-string-using-c11
     std::vector<std::string> split(const std::string &s, char delim) {
         std::stringstream ss(s);
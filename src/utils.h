@@ -9,6 +9,7 @@
 #include <vector>
 #include <sys/types.h>
 #include <cstddef>
+#include <cstdint>
 
 #define UNUSED(e, ...)      (void) ((void) (e), ##__VA_ARGS__)
 #define UNUSED_ATTR         __attribute__((unused))
@@ -19,6 +20,10 @@ namespace ngram_tokenizer {
 
     int utf8_validatestr(const u_int8_t *, size_t);
 
+    uint32_t utf8_decode(const char *, size_t, size_t *);
+
+    bool is_cjk(uint32_t);
+
     std::vector<std::string> split(const std::string &, char);
 
     std::string trim(const std::string &);